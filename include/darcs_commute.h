@@ -3,6 +3,7 @@
 
 #include "darcs_types.h"
 #include <functional>
+#include <list>
 
 namespace DarcsPatch {
     /*
@@ -122,11 +123,11 @@ namespace DarcsPatch {
             if (DARCH_PATCH_DEBUG_LOGGING) std::cout << "speedyCommute called with arguments p = " << p << "\n";
             // (p1@(FP f1 _) :> p2@(FP f2 _))
             // saves the FP to p1 and p2 in addition to extracting their members
-            auto p1 = p.v1;
-            auto p2 = p.v2;
-            auto f1 = p1.anchor_path;
-            auto f2 = p2.anchor_path;
-            if (f1 != f2) {
+            //
+            // the paths are compared by their interned ids
+            const auto & p1 = p.v1;
+            const auto & p2 = p.v2;
+            if (p1.anchor_path != p2.anchor_path) {
                 return {SUCCEEDED, {p2, p1}};
             }
             return {UNKNOWN, {}};
@@ -144,7 +145,7 @@ namespace DarcsPatch {
                 FL<char_t> tmp1;
                 cs.extract(c1, tmp1);
                 char ch1 = c1;
-                if (ch1 == '\\') {
+                if (ch1 == '\\' && tmp1.size() != 0) {
                     char_t c2;
                     FL<char_t> tmp2;
                     tmp1.extract(c2, tmp2);
@@ -156,7 +157,7 @@ namespace DarcsPatch {
                     m += (ch2);
                     m += "' not supported";
                     throw new std::runtime_error(m);
-                } else {
+                } else if (tmp1.size() > 1) {
                     char_t c2;
                     FL<char_t> tmp2;
                     tmp1.extract(c2, tmp2);
@@ -167,70 +168,50 @@ namespace DarcsPatch {
                         tmp2.extract(c3, tmp3);
                         return [=] (const char_t & f) { return (f >= c1 && f <= c3) || normalRegChars<char_t>(tmp3)(f); };
                     }
-                    return [=] (const char_t & f) { return f == c1 || normalRegChars<char_t>(tmp1)(f); };
                 }
+                return [=] (const char_t & f) { return f == c1 || normalRegChars<char_t>(tmp1)(f); };
             }
         }
 
         template <typename char_t>
         static FL<char_t> unescapeChars(const FL<char_t> & cs) {
             if (DARCH_PATCH_DEBUG_LOGGING) std::cout << "unescapeChars called with arguments cs = " << cs << "\n";
-            if (cs.size() == 0) {
-                return cs;
-            } else {
-                char_t c1;
-                FL<char_t> tmp1;
-                cs.extract(c1, tmp1);
+            std::vector<char_t> chars;
+            chars.reserve(cs.size());
+            const std::size_t size = cs.size();
+            for (std::size_t i = 0; i < size; i++) {
+                char_t c1 = cs[i];
                 char ch1 = c1;
-                if (ch1 == '\\') {
-                    char_t c2;
-                    FL<char_t> tmp2;
-                    tmp1.extract(c2, tmp2);
-                    char ch2 = c2;
-                    if (ch2 == 'n') {
-                        FL<char_t> tmp3;
-                        tmp3 = tmp3.push('\n');
-                        tmp3 = tmp3.push(unescapeChars<char_t>(tmp2));
-                        return tmp3;
-                    } else if (ch2 == 't') {
-                        FL<char_t> tmp3;
-                        tmp3 = tmp3.push('\t');
-                        tmp3 = tmp3.push(unescapeChars<char_t>(tmp2));
-                        return tmp3;
-                    } else if (ch2 == '^') {
-                        FL<char_t> tmp3;
-                        tmp3 = tmp3.push('^');
-                        tmp3 = tmp3.push(unescapeChars<char_t>(tmp2));
-                        return tmp3;
+                if (ch1 == '\\' && i + 1 < size) {
+                    char ch2 = cs[i + 1];
+                    if (ch2 == 'n' || ch2 == 't' || ch2 == '^') {
+                        chars.push_back(ch2 == 'n' ? '\n' : ch2 == 't' ? '\t' : '^');
+                        i++;
+                        continue;
                     }
                 }
-                FL<char_t> tmp2;
-                tmp2 = tmp2.push(c1);
-                tmp2 = tmp2.push(unescapeChars<char_t>(tmp1));
-                return tmp2;
+                chars.push_back(c1);
+            }
+            // an FL lists the last pushed item first
+            typename FL<char_t>::Builder builder;
+            builder.reserve(chars.size());
+            for (auto c = chars.rbegin(); c != chars.rend(); ++c) {
+                builder.push(*c);
             }
+            return builder.freeze();
         }
 
+        // normalRegChars and unescapeChars compiled to a table, see TokChars
         template <typename char_t>
         static std::function<bool(const char_t &)> RegChars(const FL<char_t> & cs) {
             if (DARCH_PATCH_DEBUG_LOGGING) std::cout << "RegChars called with arguments cs = " << cs << "\n";
-            char cs0 = cs[0];
-            if (cs0 == '^') {
-                char_t c;
-                FL<char_t> tmp;
-                cs.extract(c, tmp);
-                return [=] (const char_t & f) { return ! normalRegChars<char_t>(unescapeChars<char_t>(tmp))(f); };
-            } else {
-                char cs1 = cs[1];
-                if (cs0 == '\\' && cs1 == '^') {
-                    char_t c;
-                    FL<char_t> tmp;
-                    cs.extract(c, tmp);
-                    return [=] (const char_t & f) { return normalRegChars<char_t>(unescapeChars<char_t>(tmp))(f); };
-                } else {
-                    return [=] (const char_t & f) { return normalRegChars<char_t>(unescapeChars<char_t>(cs))(f); };
-                }
+            std::vector<char_t> spec;
+            spec.reserve(cs.size());
+            for (std::size_t i = 0; i < cs.size(); i++) {
+                spec.push_back(cs[i]);
             }
+            auto chars = std::make_shared<const TokChars<char_t>>(spec);
+            return [=] (const char_t & f) { return (*chars)(f); };
         }
 
         template <
@@ -240,11 +221,8 @@ namespace DarcsPatch {
         >
         static std::function<bool(const char_t &)> RegChars(const adapter_t & cs) {
             if (DARCH_PATCH_DEBUG_LOGGING) std::cout << "RegChars called with arguments cs = " << cs << "\n";
-            FL<char_t> cs_;
-            for (const char_t & c : cs) {
-                cs_ = cs_.push(c);
-            }
-            return RegChars<char_t>(cs_);
+            auto chars = TokReplace<char_t, adapter_t>::compile(cs);
+            return [=] (const char_t & f) { return (*chars)(f); };
         }
 
         //
@@ -403,15 +381,16 @@ namespace DarcsPatch {
             typename adapter_t,
             typename AdapterMustExtendBasicStringAdapter = typename std::enable_if<std::is_base_of<StringAdapter::BasicStringAdapter<char_t>, adapter_t>::value>::type
         >
-        static Maybe<RL<std::shared_ptr<adapter_t>>> loop(const std::size_t & from, const adapter_t & tokChars, const adapter_t & o, const adapter_t & n, const std::shared_ptr<adapter_t> & input) {
-            if (DARCH_PATCH_DEBUG_LOGGING) std::cout << "loop called with arguments from = " << from << ", tokChars = " << tokChars << ", o = " << o << ", n = " << n << ", input = " << input << "\n";
+        static Maybe<RL<std::shared_ptr<adapter_t>>> loop(const std::size_t & from, const TokChars<char_t> & tokChars, const adapter_t & o, const adapter_t & n, const std::shared_ptr<adapter_t> & input) {
+            if (DARCH_PATCH_DEBUG_LOGGING) std::cout << "loop called with arguments from = " << from << ", o = " << o << ", n = " << n << ", input = " << input << "\n";
+            auto isTok = [&tokChars] (const char_t & f) { return tokChars(f); };
             auto dropped = Drop<char_t, adapter_t>(*input.get(), from);
-            auto start = FindIndex<char_t, adapter_t>(dropped, RegChars<char_t, adapter_t>(tokChars));
+            auto start = FindIndex<char_t, adapter_t>(dropped, isTok);
             if (!start.has_value) {
                 return {{input}};
             } else {
                 auto dropped1 = Drop<char_t, adapter_t>(*input.get(), from + start.value_ref());
-                auto tmp = Span<char_t, adapter_t>(dropped1, RegChars<char_t, adapter_t>(tokChars));
+                auto tmp = Span<char_t, adapter_t>(dropped1, isTok);
                 auto tok = tmp.v1;
                 auto rest = tmp.v2;
                 if (tok == o) {
@@ -425,14 +404,15 @@ namespace DarcsPatch {
                     if (!items.has_value) {
                         return Nothing();
                     }
-                    RL<std::shared_ptr<adapter_t>> r;
+                    typename RL<std::shared_ptr<adapter_t>>::Builder r;
+                    r.reserve(items.value_ref().size());
                     for (const std::shared_ptr<adapter_t> & item : items.value_ref()) {
                         adapter_t acc = Take<char_t, adapter_t>(*input.get(), from + start.value_ref());
                         acc.append_(n);
                         acc.append_(*item.get());
-                        r = r.push(std::make_shared<adapter_t>(acc));
+                        r.push(std::make_shared<adapter_t>(acc));
                     }
-                    return {r};
+                    return {r.freeze()};
                 }
                 if (tok == n) {
                     return Nothing();
@@ -441,41 +421,168 @@ namespace DarcsPatch {
             }
         }
 
+        // the checks tryTokReplace makes of o and n, done once for any
+        // number of lines
+        //
+        // each line is scanned in one pass, each character is tested in the
+        // same order as loop tests it. the characters of a token are copied
+        // to the result as they are read, and swapped for n once the token
+        // turns out to be o
+        //
         template <
             typename char_t,
             typename adapter_t,
             typename AdapterMustExtendBasicStringAdapter = typename std::enable_if<std::is_base_of<StringAdapter::BasicStringAdapter<char_t>, adapter_t>::value>::type
         >
-        static Maybe<adapter_t> tryTokReplace(const adapter_t & tokChars, const adapter_t & o, const adapter_t & n, const adapter_t & input) {
-            if (DARCH_PATCH_DEBUG_LOGGING) std::cout << "tryTokReplace called with arguments tokChars = " << tokChars << ", o = " << o << ", n = " << n << ", input = " << input << "\n";
-            if (o.size() == 0) {
-                throw new std::runtime_error("tryTokReplace called with empty old token");
+        struct TokenReplacer {
+            const TokChars<char_t> & tokChars;
+            const adapter_t & n;
+            std::vector<char_t> old_token;
+            std::vector<char_t> new_token;
+            std::uint64_t old_bloom;
+            std::uint64_t new_bloom;
+
+            TokenReplacer(const TokChars<char_t> & tokChars, const adapter_t & o, const adapter_t & n) : tokChars(tokChars), n(n) {
+                if (o.size() == 0) {
+                    throw new std::runtime_error("tryTokReplace called with empty old token");
+                }
+                if (Any<char_t, adapter_t>(o, [&tokChars] (const char_t & f) { return ! tokChars(f); })) {
+                    throw new std::runtime_error("tryTokReplace called with old non-token");
+                }
+                if (Any<char_t, adapter_t>(n, [&tokChars] (const char_t & f) { return ! tokChars(f); })) {
+                    throw new std::runtime_error("tryTokReplace called with new non-token");
+                }
+                old_token.assign(o.begin(), o.end());
+                new_token.assign(n.begin(), n.end());
+                old_bloom = TokenBloom<char_t>::of_token(old_token.begin(), old_token.end());
+                new_bloom = TokenBloom<char_t>::of_token(new_token.begin(), new_token.end());
             }
-            if (o.size() == 0) {
-                throw new std::runtime_error("tryTokReplace called with empty old token");
+
+            // whether a line with this TokenBloom can have an o or n token,
+            // the tokens it has under the default class
+            bool may_change(const std::uint64_t bloom) const {
+                return TokenBloom<char_t>::may_have(bloom, old_bloom) || (new_token.size() != 0 && TokenBloom<char_t>::may_have(bloom, new_bloom));
             }
-            if (Any<char_t, adapter_t>(o, [=] (const char_t & f) { return ! RegChars<char_t, adapter_t>(tokChars)(f); })) {
-                throw new std::runtime_error("tryTokReplace called with old non-token");
+
+            // fmap B.concat . loop 0
+            Maybe<adapter_t> operator()(const adapter_t & input) const {
+                if constexpr (sizeof(char_t) == 1) {
+                    // nothing can throw, so the tokens can be found a block
+                    // of characters at a time, and a line without an o
+                    // token is returned as it is
+                    if (!tokChars.can_throw()) {
+                        return scan(input);
+                    }
+                }
+                adapter_t acc;
+                std::size_t length = 0;
+                bool is_old = true;
+                bool is_new = true;
+                auto end_token = [&] {
+                    if (length != 0) {
+                        if (is_old && length == old_token.size()) {
+                            acc.erase(acc.size() - length, length);
+                            acc.append_(n);
+                        } else if (is_new && length == new_token.size()) {
+                            return false;
+                        }
+                    }
+                    length = 0;
+                    is_old = true;
+                    is_new = true;
+                    return true;
+                };
+                for (const char_t & c : input) {
+                    if (tokChars(c)) {
+                        is_old = is_old && length < old_token.size() && old_token[length] == c;
+                        is_new = is_new && length < new_token.size() && new_token[length] == c;
+                        length++;
+                    } else if (!end_token()) {
+                        return Nothing();
+                    }
+                    acc.append(c);
+                }
+                if (!end_token()) {
+                    return Nothing();
+                }
+                return {acc};
             }
-            if (Any<char_t, adapter_t>(n, [=] (const char_t & f) { return ! RegChars<char_t, adapter_t>(tokChars)(f); })) {
-                throw new std::runtime_error("tryTokReplace called with new non-token");
+
+            // only a token that starts with the first character of o or of n
+            // can be either, and it is o or n when it is followed by a
+            // character that is not a token character, as they are made of
+            // token characters
+            Maybe<adapter_t> scan(const adapter_t & input) const {
+                auto & cs = input.c_str();
+                const char_t * p = reinterpret_cast<const char_t *>(cs.ptr());
+                const std::size_t size = cs.lengthInBytes();
+                auto is = [&](const std::size_t start, const std::vector<char_t> & token) {
+                    const std::size_t end = start + token.size();
+                    return token.size() != 0 && end <= size && std::equal(token.begin(), token.end(), p + start) && (end == size || !tokChars(p[end]));
+                };
+                // acc holds the characters before `copied` once an o token
+                // has been found
+                adapter_t acc;
+                std::size_t copied = 0;
+                bool replaced = false;
+                const char_t new_first = new_token.size() != 0 ? new_token[0] : old_token[0];
+                const bool found_new = !tokChars.token_starts(p, size, old_token[0], new_first, [&](const std::size_t start) {
+                    if (is(start, old_token)) {
+                        for (; copied < start; copied++) {
+                            acc.append(p[copied]);
+                        }
+                        acc.append_(n);
+                        copied = start + old_token.size();
+                        replaced = true;
+                        return true;
+                    }
+                    return !is(start, new_token);
+                });
+                if (found_new) {
+                    return Nothing();
+                }
+                if (!replaced) {
+                    return {input};
+                }
+                for (; copied < size; copied++) {
+                    acc.append(p[copied]);
+                }
+                return {acc};
             }
 
-            // fmap B.concat . loop 0
+            // mapM, Nothing if any line is
             //
-            // for each item in `loop 0 input`
-            //   concat the result to a single item and then return that item
+            // blooms, when given, are the TokenBloom of each item and
+            // tokChars is the default class, the items that can not have an
+            // o or n token are kept as they are
             //
-
-            auto items1 = loop<char_t, adapter_t>(0, tokChars, o, n, std::make_shared<adapter_t>(input));
-            if (!items1.has_value) {
-                return Nothing();
-            }
-            adapter_t acc;
-            for (const std::shared_ptr<adapter_t> & item : items1.value_ref()) {
-                acc.append_(*item.get());
+            Maybe<RL<adapter_t>> operator()(const RL<adapter_t> & items, const std::vector<std::uint64_t> * blooms = nullptr) const {
+                typename RL<adapter_t>::Builder result;
+                result.reserve(items.size());
+                std::size_t i = 0;
+                for (const adapter_t & item : items) {
+                    if (blooms != nullptr && !may_change((*blooms)[i++])) {
+                        result.push(item);
+                        continue;
+                    }
+                    Maybe<adapter_t> m = (*this)(item);
+                    if (!m.has_value) {
+                        return Nothing();
+                    }
+                    result.push(m.value_ref());
+                }
+                return {result.freeze()};
             }
-            return {acc};
+        };
+
+        template <
+            typename char_t,
+            typename adapter_t,
+            typename AdapterMustExtendBasicStringAdapter = typename std::enable_if<std::is_base_of<StringAdapter::BasicStringAdapter<char_t>, adapter_t>::value>::type
+        >
+        static Maybe<adapter_t> tryTokReplace(const TokChars<char_t> & tokChars, const adapter_t & o, const adapter_t & n, const adapter_t & input) {
+            if (DARCH_PATCH_DEBUG_LOGGING) std::cout << "tryTokReplace called with arguments o = " << o << ", n = " << n << ", input = " << input << "\n";
+            return TokenReplacer<char_t, adapter_t>(tokChars, o, n)(input);
         }
 
         template <
@@ -483,8 +590,17 @@ namespace DarcsPatch {
             typename adapter_t,
             typename AdapterMustExtendBasicStringAdapter = typename std::enable_if<std::is_base_of<StringAdapter::BasicStringAdapter<char_t>, adapter_t>::value>::type
         >
-        static Maybe<RL<adapter_t>> tryTokReplaces(const adapter_t & t, const adapter_t & o, const adapter_t & n, const RL<adapter_t>& items) {
-            if (DARCH_PATCH_DEBUG_LOGGING) std::cout << "tryTokReplaces called with arguments t = " << t << ", o = " << o << ", n = " << n << ", items = " << items << "\n";
+        static Maybe<adapter_t> tryTokReplace(const adapter_t & tokChars, const adapter_t & o, const adapter_t & n, const adapter_t & input) {
+            return tryTokReplace<char_t, adapter_t>(*TokReplace<char_t, adapter_t>::compile(tokChars), o, n, input);
+        }
+
+        template <
+            typename char_t,
+            typename adapter_t,
+            typename AdapterMustExtendBasicStringAdapter = typename std::enable_if<std::is_base_of<StringAdapter::BasicStringAdapter<char_t>, adapter_t>::value>::type
+        >
+        static Maybe<RL<adapter_t>> tryTokReplaces(const TokChars<char_t> & t, const adapter_t & o, const adapter_t & n, const RL<adapter_t>& items) {
+            if (DARCH_PATCH_DEBUG_LOGGING) std::cout << "tryTokReplaces called with arguments o = " << o << ", n = " << n << ", items = " << items << "\n";
             // tryTokReplaces :: String -> B.ByteString -> B.ByteString
             //                -> [B.ByteString] -> Maybe [B.ByteString]
             // tryTokReplaces t o n = mapM (tryTokReplace t o n)
@@ -496,15 +612,54 @@ namespace DarcsPatch {
             // for each item in the list new1, invoke tryTokReplace t o n item
             // if the invokation returns Nothing then return Nothing
             // otherwise add the result to a list and then return that list as long as Nothing is never returned
-            RL<adapter_t> result;
-            for (const adapter_t & item : items) {
-                Maybe<adapter_t> m = tryTokReplace<char_t, adapter_t>(t, o, n, item);
-                if (!m.has_value) {
-                    return Nothing();
-                }
-                result = result.push(m.value_ref());
+            //
+            // o and n are only checked when there is an item
+            if (items.size() == 0) {
+                return {items};
             }
-            return {result};
+            return TokenReplacer<char_t, adapter_t>(t, o, n)(items);
+        }
+
+        // tryTokReplaces over the old lines and then the new lines of a
+        // hunk, checking o and n once for both
+        //
+        // old_blooms and new_blooms, when given, are the TokenBlooms of the
+        // lines, the lines their blooms rule out are not scanned when t is
+        // the default token class
+        //
+        template <
+            typename char_t,
+            typename adapter_t,
+            typename AdapterMustExtendBasicStringAdapter = typename std::enable_if<std::is_base_of<StringAdapter::BasicStringAdapter<char_t>, adapter_t>::value>::type
+        >
+        static Maybe<Tuple2<RL<adapter_t>, RL<adapter_t>>> tryTokReplacesHunk(const TokChars<char_t> & t, const adapter_t & o, const adapter_t & n, const RL<adapter_t>& old_lines, const RL<adapter_t>& new_lines, const std::vector<std::uint64_t> * old_blooms = nullptr, const std::vector<std::uint64_t> * new_blooms = nullptr) {
+            if (DARCH_PATCH_DEBUG_LOGGING) std::cout << "tryTokReplacesHunk called with arguments o = " << o << ", n = " << n << ", old_lines = " << old_lines << ", new_lines = " << new_lines << "\n";
+            if (old_lines.size() == 0 && new_lines.size() == 0) {
+                return {{old_lines, new_lines}};
+            }
+            const TokenReplacer<char_t, adapter_t> replace(t, o, n);
+            if (t != TokenBloom<char_t>::default_chars()) {
+                old_blooms = nullptr;
+                new_blooms = nullptr;
+            }
+            auto old1 = replace(old_lines, old_blooms);
+            if (!old1.has_value) {
+                return Nothing();
+            }
+            auto new1 = replace(new_lines, new_blooms);
+            if (!new1.has_value) {
+                return Nothing();
+            }
+            return {{old1.value_ref(), new1.value_ref()}};
+        }
+
+        template <
+            typename char_t,
+            typename adapter_t,
+            typename AdapterMustExtendBasicStringAdapter = typename std::enable_if<std::is_base_of<StringAdapter::BasicStringAdapter<char_t>, adapter_t>::value>::type
+        >
+        static Maybe<RL<adapter_t>> tryTokReplaces(const adapter_t & t, const adapter_t & o, const adapter_t & n, const RL<adapter_t>& items) {
+            return tryTokReplaces<char_t, adapter_t>(*TokReplace<char_t, adapter_t>::compile(t), o, n, items);
         }
 
         static Maybe<Tuple2<std::size_t, std::size_t>> commuteHunkLines(
@@ -527,94 +682,167 @@ namespace DarcsPatch {
             else return Nothing();
         }
 
+        // a prim as it is, or as its inverse without making the inverse
+        //
+        // inverting a hunk or a token replace gives a patch of the same
+        // type with its old and new sides swapped, so the view swaps them
+        // when it is read. the patches made from a view are made as they
+        // would be for the prim it views, see commuteFP
+        //
+        template <
+            typename char_t,
+            typename adapter_t,
+            typename AdapterMustExtendBasicStringAdapter = typename std::enable_if<std::is_base_of<StringAdapter::BasicStringAdapter<char_t>, adapter_t>::value>::type
+        >
+        struct PrimView {
+            const std::shared_ptr<Patch> & patch;
+            const bool inverted;
+
+            PrimView(const std::shared_ptr<Patch> & patch, const bool inverted) : patch(patch), inverted(inverted) {}
+
+            PATCH_TYPE type() const {
+                return patch->type();
+            }
+
+            const FileHunk<char_t, adapter_t> & hunk() const {
+                return *static_cast<const FileHunk<char_t, adapter_t>*>(patch.get());
+            }
+
+            const TokReplace<char_t, adapter_t> & tok() const {
+                return *static_cast<const TokReplace<char_t, adapter_t>*>(patch.get());
+            }
+
+            const RL<adapter_t> & old_lines() const {
+                return inverted ? hunk().new_lines : hunk().old_lines;
+            }
+
+            const RL<adapter_t> & new_lines() const {
+                return inverted ? hunk().old_lines : hunk().new_lines;
+            }
+
+            const std::vector<std::uint64_t> & old_blooms() const {
+                return inverted ? hunk().new_blooms() : hunk().old_blooms();
+            }
+
+            const std::vector<std::uint64_t> & new_blooms() const {
+                return inverted ? hunk().old_blooms() : hunk().new_blooms();
+            }
+
+            const adapter_t & o() const {
+                return inverted ? tok().n : tok().o;
+            }
+
+            const adapter_t & n() const {
+                return inverted ? tok().o : tok().n;
+            }
+
+            // the hunk at another line
+            std::shared_ptr<Patch> at_line(const std::size_t & line) const {
+                return hunk().at_line(line);
+            }
+
+            // a hunk at the line of this one, with the lines given in the
+            // order this view reads them
+            std::shared_ptr<Patch> with_lines(const RL<adapter_t> & old_lines, const RL<adapter_t> & new_lines) const {
+                return inverted ? makeHunk<char_t, adapter_t>(hunk().line, new_lines, old_lines) : makeHunk<char_t, adapter_t>(hunk().line, old_lines, new_lines);
+            }
+
+            std::shared_ptr<Patch> copy() const {
+                return std::make_shared<TokReplace<char_t, adapter_t>>(tok());
+            }
+        };
+
+        // commutes p.v1 :> p.v2, or when inverted gives what commuting
+        // invert(p.v2) :> invert(p.v1) and then inverting and swapping the
+        // result would give, without inverting any patch
+        //
+        // either way the first patch of the result is made from p.v2 and
+        // the second from p.v1
+        //
         template <
             typename char_t,
             typename adapter_t,
             typename AdapterMustExtendBasicStringAdapter = typename std::enable_if<std::is_base_of<StringAdapter::BasicStringAdapter<char_t>, adapter_t>::value>::type
         >
-        static Perhaps<Tuple2<Core_FP<char_t, adapter_t>, Core_FP<char_t, adapter_t>>> commuteFP(const AnchorPath<char_t, adapter_t> & f, const Tuple2<std::shared_ptr<Patch>, std::shared_ptr<Patch>> & p) {
-            if (DARCH_PATCH_DEBUG_LOGGING) std::cout << "commuteFP called with arguments f = " << f << ", p = " << p << "\n";
-            if (p.v2->type() == HUNK) {
-                FileHunk<char_t, adapter_t> * f2 = static_cast<FileHunk<char_t, adapter_t>*>(p.v2.get());
-                if (f2->old_lines == NilRL && f2->new_lines == NilRL) {
-                    return {SUCCEEDED, { Core_FP<char_t, adapter_t>(f, p.v2), Core_FP<char_t, adapter_t>(f, p.v1) }};
+        static Perhaps<Tuple2<Core_FP<char_t, adapter_t>, Core_FP<char_t, adapter_t>>> commuteFP(const AnchorPath<char_t, adapter_t> & f, const Tuple2<std::shared_ptr<Patch>, std::shared_ptr<Patch>> & p, const bool inverted = false) {
+            if (DARCH_PATCH_DEBUG_LOGGING) std::cout << "commuteFP called with arguments f = " << f << ", p = " << p << ", inverted = " << inverted << "\n";
+            // the pair in the order it is commuted in
+            const PrimView<char_t, adapter_t> v1(inverted ? p.v2 : p.v1, inverted);
+            const PrimView<char_t, adapter_t> v2(inverted ? p.v1 : p.v2, inverted);
+            auto result = [&] (const std::shared_ptr<Patch> & from_v2, const std::shared_ptr<Patch> & from_v1) -> Perhaps<Tuple2<Core_FP<char_t, adapter_t>, Core_FP<char_t, adapter_t>>> {
+                if (inverted) {
+                    return {SUCCEEDED, { Core_FP<char_t, adapter_t>(f, from_v1), Core_FP<char_t, adapter_t>(f, from_v2) }};
+                }
+                return {SUCCEEDED, { Core_FP<char_t, adapter_t>(f, from_v2), Core_FP<char_t, adapter_t>(f, from_v1) }};
+            };
+            if (v2.type() == HUNK) {
+                if (v2.old_lines() == NilRL && v2.new_lines() == NilRL) {
+                    return result(v2.patch, v1.patch);
                 }
             }
-            if (p.v1->type() == HUNK) {
-                FileHunk<char_t, adapter_t> * f1 = static_cast<FileHunk<char_t, adapter_t>*>(p.v1.get());
-                if (f1->old_lines == NilRL && f1->new_lines == NilRL) {
-                    return {SUCCEEDED, { Core_FP<char_t, adapter_t>(f, p.v2), Core_FP<char_t, adapter_t>(f, p.v1) }};
+            if (v1.type() == HUNK) {
+                if (v1.old_lines() == NilRL && v1.new_lines() == NilRL) {
+                    return result(v2.patch, v1.patch);
                 }
             }
-            if (p.v1->type() == HUNK && p.v2->type() == HUNK) {
-                FileHunk<char_t, adapter_t> * f1 = static_cast<FileHunk<char_t, adapter_t>*>(p.v1.get());
-                FileHunk<char_t, adapter_t> * f2 = static_cast<FileHunk<char_t, adapter_t>*>(p.v2.get());
-                if (DARCH_PATCH_DEBUG_LOGGING) std::cout << "calling commuteHunkLines with arguments f1 = " << *f1 << ", f2 = " << *f2 << "\n";
-                auto m = commuteHunkLines(f1->line, f1->old_lines.size(), f1->new_lines.size(), f2->line, f2->old_lines.size(), f2->new_lines.size());
+            if (v1.type() == HUNK && v2.type() == HUNK) {
+                const FileHunk<char_t, adapter_t> & f1 = v1.hunk();
+                const FileHunk<char_t, adapter_t> & f2 = v2.hunk();
+                if (DARCH_PATCH_DEBUG_LOGGING) std::cout << "calling commuteHunkLines with arguments f1 = " << f1 << ", f2 = " << f2 << "\n";
+                auto m = commuteHunkLines(f1.line, v1.old_lines().size(), v1.new_lines().size(), f2.line, v2.old_lines().size(), v2.new_lines().size());
                 if (!m.has_value) {
                     return {FAILED, {}};
                 } else {
                     auto line2 = m->v1;
                     auto line1 = m->v2;
-                    Tuple2<Core_FP<char_t, adapter_t>, Core_FP<char_t, adapter_t>> t;
-                    t.v1 = Core_FP<char_t, adapter_t>(f, makeHunk<char_t, adapter_t>(line2, f2->old_lines, f2->new_lines));
-                    t.v2 = Core_FP<char_t, adapter_t>(f, makeHunk<char_t, adapter_t>(line1, f1->old_lines, f1->new_lines));
-                    return {SUCCEEDED, t};
+                    return result(v2.at_line(line2), v1.at_line(line1));
                 }
             }
-            if (p.v1->type() == HUNK && p.v2->type() == TOK_REPLACE) {
-                FileHunk<char_t, adapter_t> * f1 = static_cast<FileHunk<char_t, adapter_t>*>(p.v1.get());
-                TokReplace<char_t, adapter_t> * t1 = static_cast<TokReplace<char_t, adapter_t>*>(p.v2.get());
-                auto & po = t1->o;
-                auto & pn = t1->n;
-                auto tmp = tryTokReplaces<char_t, adapter_t>(t1->t, po, pn, f1->old_lines);
+            if (v1.type() == HUNK && v2.type() == TOK_REPLACE) {
+                const TokReplace<char_t, adapter_t> & t1 = v2.tok();
+                // the blooms are only made for the class they are made with
+                const bool blooms = *t1.chars == TokenBloom<char_t>::default_chars();
+                auto tmp = tryTokReplacesHunk<char_t, adapter_t>(*t1.chars, v2.o(), v2.n(), v1.old_lines(), v1.new_lines(), blooms ? &v1.old_blooms() : nullptr, blooms ? &v1.new_blooms() : nullptr);
                 if (!tmp.has_value) {
                     return {FAILED, {}};
                 }
-                auto & old1 = tmp.value_ref();
-                auto tmp1 = tryTokReplaces<char_t, adapter_t>(t1->t, po, pn, f1->new_lines);
-                if (!tmp1.has_value) {
-                    return {FAILED, {}};
-                }
-                auto & new1 = tmp1.value_ref();
-                Tuple2<Core_FP<char_t, adapter_t>, Core_FP<char_t, adapter_t>> t;
-                t.v1 = Core_FP<char_t, adapter_t>(f, makeTokReplace<char_t, adapter_t>(t1->t, t1->o, t1->n));
-                t.v2 = Core_FP<char_t, adapter_t>(f, makeHunk<char_t, adapter_t>(f1->line, old1, new1));
-                return {SUCCEEDED, t};
-            }
-            if (p.v1->type() == TOK_REPLACE && p.v2->type() == TOK_REPLACE) {
-                TokReplace<char_t, adapter_t> * t1 = static_cast<TokReplace<char_t, adapter_t>*>(p.v1.get());
-                TokReplace<char_t, adapter_t> * t2 = static_cast<TokReplace<char_t, adapter_t>*>(p.v2.get());
-                if (t1->t != t2->t) return {FAILED, {}};
-                if (t1->o == t2->o) return {FAILED, {}};
-                if (t1->n == t2->o) return {FAILED, {}};
-                if (t1->o == t2->n) return {FAILED, {}};
-                if (t1->n == t2->n) return {FAILED, {}};
-                Tuple2<Core_FP<char_t, adapter_t>, Core_FP<char_t, adapter_t>> t;
-                t.v1 = Core_FP<char_t, adapter_t>(f, makeTokReplace<char_t, adapter_t>(t2->t, t2->o, t2->n));
-                t.v2 = Core_FP<char_t, adapter_t>(f, makeTokReplace<char_t, adapter_t>(t1->t, t1->o, t1->n));
-                return {SUCCEEDED, t};
+                auto & old1 = tmp->v1;
+                auto & new1 = tmp->v2;
+                return result(v2.copy(), v1.with_lines(old1, new1));
+            }
+            if (v1.type() == TOK_REPLACE && v2.type() == TOK_REPLACE) {
+                // the same tests either way round, inverting both patches
+                // swaps o and n in each of them
+                const TokReplace<char_t, adapter_t> & t1 = v1.tok();
+                const TokReplace<char_t, adapter_t> & t2 = v2.tok();
+                if (t1.t != t2.t) return {FAILED, {}};
+                if (t1.o == t2.o) return {FAILED, {}};
+                if (t1.n == t2.o) return {FAILED, {}};
+                if (t1.o == t2.n) return {FAILED, {}};
+                if (t1.n == t2.n) return {FAILED, {}};
+                return result(v2.copy(), v1.copy());
             }
             return {UNKNOWN, {}};
         }
 
+        // commuteFP after the paths, inverted as commuteFP is
         template <
             typename char_t,
             typename adapter_t,
             typename AdapterMustExtendBasicStringAdapter = typename std::enable_if<std::is_base_of<StringAdapter::BasicStringAdapter<char_t>, adapter_t>::value>::type
         >
-        static Perhaps<Tuple2<Core_FP<char_t, adapter_t>, Core_FP<char_t, adapter_t>>> commuteFileDir(const Tuple2<Core_FP<char_t, adapter_t>, Core_FP<char_t, adapter_t>> & p) {
-            if (DARCH_PATCH_DEBUG_LOGGING) std::cout << "commuteFileDir called with arguments p = " << p << "\n";
-            auto fp1 = p.v1;
-            auto fp2 = p.v2;
-            auto f1 = fp1.anchor_path;
-            auto f2 = fp2.anchor_path;
-            auto p1 = fp1.patch;
-            auto p2 = fp2.patch;
+        static Perhaps<Tuple2<Core_FP<char_t, adapter_t>, Core_FP<char_t, adapter_t>>> commuteFileDir(const Tuple2<Core_FP<char_t, adapter_t>, Core_FP<char_t, adapter_t>> & p, const bool inverted = false) {
+            if (DARCH_PATCH_DEBUG_LOGGING) std::cout << "commuteFileDir called with arguments p = " << p << ", inverted = " << inverted << "\n";
+            const auto & fp1 = p.v1;
+            const auto & fp2 = p.v2;
+            const auto & f1 = fp1.anchor_path;
+            const auto & f2 = fp2.anchor_path;
+            const auto & p1 = fp1.patch;
+            const auto & p2 = fp2.patch;
             if (f1 != f2) {
-                return {SUCCEEDED, {Core_FP<char_t, adapter_t>(f2, p2), Core_FP<char_t, adapter_t>(f1, p1)}};
+                return {SUCCEEDED, {fp2, fp1}};
             } else {
-                return commuteFP<char_t, adapter_t>(f1, {p1, p2});
+                return commuteFP<char_t, adapter_t>(f1, {p1, p2}, inverted);
             }
         }
 
@@ -634,11 +862,9 @@ namespace DarcsPatch {
             if (tmp.v1 == FAILED) {
                 return {FAILED, {}};
             }
-            auto tmp2 = commuteFileDir<char_t, adapter_t>({invert(p2), invert(p1)});
-            if (tmp2.v1 == SUCCEEDED) {
-                return {SUCCEEDED, {invert(tmp2.v2.v2), invert(tmp2.v2.v1)}};
-            }
-            return {tmp2.v1, {}};
+            // commuteFileDir({invert(p2), invert(p1)}) with the result
+            // inverted back, read through inverse views
+            return commuteFileDir<char_t, adapter_t>({p1, p2}, true);
         }
 
         template <
@@ -766,6 +992,15 @@ namespace DarcsPatch {
             if ((p.v1.d.size() != 0 && p.v1.d.contains(p.v2.n)) || (p.v2.d.size() != 0 && p.v2.d.contains(p.v1.n))) {
                 return Nothing();
             }
+            // prims on files the other patch does not touch always commute
+            // unchanged, commute1_ would only hand back the prims of the
+            // first patch in reverse order, as ToFL(ToRL()) does
+            if (!p.v1.touched()->touches_any_of(*p.v2.touched())) {
+                if (p.v1.p == NilFL || p.v2.p == NilFL) {
+                    return {{p.v2, p.v1}};
+                }
+                return {{p.v2, p.v1.reversed()}};
+            }
             Tuple2<FL<Core_FP<char_t, adapter_t>>, FL<Core_FP<char_t, adapter_t>>> t;
             t.v1 = p.v1.p;
             t.v2 = p.v2.p;
@@ -940,6 +1175,127 @@ namespace DarcsPatch {
     //     return {ys1.append(y1), x2};
     // }
 
+    // a bounded cache of commute results, safe to share between threads
+    //
+    // commutes are pure, so the result for a pair of patches can be reused
+    // while a history is folded and across calls sharing the cache. pairs
+    // are keyed by their whole contents rather than their PatchInfo, as the
+    // patches of p_and_deps keep their ident while their hunks move.
+    //
+    // pairs are spread over shards that each have their own lock and drop
+    // their least recently used pair once full.
+    template <typename P>
+    class CommuteCache {
+        using PAIR = Tuple2<P, P>;
+        using RESULT = Maybe<Tuple2<P, P>>;
+
+        static constexpr std::size_t SHARDS = 16;
+
+        struct Entry {
+            PAIR pair;
+            RESULT result;
+        };
+
+        struct Shard {
+            std::mutex mutex;
+            // most recently used first
+            std::list<Entry> entries;
+            std::unordered_multimap<std::size_t, typename std::list<Entry>::iterator> by_hash;
+        };
+
+        const std::size_t shard_capacity;
+        std::unique_ptr<Shard[]> shards;
+        std::atomic<std::size_t> hits_ { 0 };
+        std::atomic<std::size_t> misses_ { 0 };
+
+        static std::size_t hash(const PAIR & pair) {
+            return 31 * pair.v1.hashCode() + pair.v2.hashCode();
+        }
+
+        // finds pair in shard, its mutex must be held
+        static Entry * find(Shard & shard, const std::size_t h, const PAIR & pair) {
+            auto range = shard.by_hash.equal_range(h);
+            for (auto it = range.first; it != range.second; ++it) {
+                if (it->second->pair.v1 == pair.v1 && it->second->pair.v2 == pair.v2) {
+                    shard.entries.splice(shard.entries.begin(), shard.entries, it->second);
+                    return &*it->second;
+                }
+            }
+            return nullptr;
+        }
+
+        public:
+
+        CommuteCache(const std::size_t capacity = 65536) :
+            shard_capacity(std::max(std::size_t(1), (capacity + SHARDS - 1) / SHARDS)),
+            shards(new Shard[SHARDS])
+        {}
+
+        CommuteCache(const CommuteCache &) = delete;
+        CommuteCache & operator =(const CommuteCache &) = delete;
+
+        // the result of commute(pair), calling it only if pair is not cached
+        template <typename COMMUTE>
+        RESULT commute(const PAIR & pair, const COMMUTE & commute) {
+            const std::size_t h = hash(pair);
+            Shard & shard = shards[(h ^ (h >> 17)) % SHARDS];
+            {
+                std::lock_guard<std::mutex> lock(shard.mutex);
+                if (Entry * entry = find(shard, h, pair)) {
+                    hits_++;
+                    return entry->result;
+                }
+            }
+            misses_++;
+            // commute without the lock, another thread may store the same
+            // pair meanwhile, which gives the same result
+            RESULT result = commute(pair);
+            std::lock_guard<std::mutex> lock(shard.mutex);
+            if (find(shard, h, pair) == nullptr) {
+                shard.entries.push_front({pair, result});
+                shard.by_hash.emplace(h, shard.entries.begin());
+                if (shard.entries.size() > shard_capacity) {
+                    auto last = std::prev(shard.entries.end());
+                    auto range = shard.by_hash.equal_range(hash(last->pair));
+                    for (auto it = range.first; it != range.second; ++it) {
+                        if (it->second == last) {
+                            shard.by_hash.erase(it);
+                            break;
+                        }
+                    }
+                    shard.entries.erase(last);
+                }
+            }
+            return result;
+        }
+
+        const std::size_t hits() const {
+            return hits_.load();
+        }
+
+        const std::size_t misses() const {
+            return misses_.load();
+        }
+
+        const std::size_t size() const {
+            std::size_t total = 0;
+            for (std::size_t i = 0; i < SHARDS; i++) {
+                std::lock_guard<std::mutex> lock(shards[i].mutex);
+                total += shards[i].entries.size();
+            }
+            return total;
+        }
+    };
+
+    template <
+        typename char_t,
+        typename adapter_t,
+        typename AdapterMustExtendBasicStringAdapter = typename std::enable_if<std::is_base_of<StringAdapter::BasicStringAdapter<char_t>, adapter_t>::value>::type
+    >
+    using NamedCommuteCache = CommuteCache<Named<Core_FP<char_t, adapter_t>, char_t, adapter_t>>;
+
+    using NamedCommuteCache_T = NamedCommuteCache<char, StringAdapter::CharAdapter>;
+
     // commuterIdFL :: CommuteFn p1 p2 -> CommuteFn p1 (FL p2)
     // commuterIdFL _ (x :> NilFL) = return (NilFL :> x)
     // commuterIdFL commuter (x :> (y :>: ys))
@@ -952,34 +1308,38 @@ namespace DarcsPatch {
         typename adapter_t,
         typename AdapterMustExtendBasicStringAdapter = typename std::enable_if<std::is_base_of<StringAdapter::BasicStringAdapter<char_t>, adapter_t>::value>::type
     >
-    Maybe<Tuple2<FL<Named<Core_FP<char_t, adapter_t>, char_t, adapter_t>>, Named<Core_FP<char_t, adapter_t>, char_t, adapter_t>>> commuterIdFL(const Tuple2<Named<Core_FP<char_t, adapter_t>, char_t, adapter_t>, FL<Named<Core_FP<char_t, adapter_t>, char_t, adapter_t>>> & p) {
+    Maybe<Tuple2<FL<Named<Core_FP<char_t, adapter_t>, char_t, adapter_t>>, Named<Core_FP<char_t, adapter_t>, char_t, adapter_t>>> commuterIdFL(const Tuple2<Named<Core_FP<char_t, adapter_t>, char_t, adapter_t>, FL<Named<Core_FP<char_t, adapter_t>, char_t, adapter_t>>> & p, CommuteCache<Named<Core_FP<char_t, adapter_t>, char_t, adapter_t>> * cache = nullptr) {
         if (DARCH_PATCH_DEBUG_LOGGING) std::cout << "commuterIdFL called with arguments p = " << p << "\n";
         if (p.v2 == NilFL) {
             return Tuple2<FL<Named<Core_FP<char_t, adapter_t>, char_t, adapter_t>>, Named<Core_FP<char_t, adapter_t>, char_t, adapter_t>>(p.v2, p.v1);
         }
+        // a loop rather than one call per item of p.v2, which can hold every
+        // patch a history depends on
         auto x = p.v1;
-        Named<Core_FP<char_t, adapter_t>, char_t, adapter_t> y;
-        FL<Named<Core_FP<char_t, adapter_t>, char_t, adapter_t>> ys;
-        p.v2.extract(y, ys);
-        Tuple2<Named<Core_FP<char_t, adapter_t>, char_t, adapter_t>, Named<Core_FP<char_t, adapter_t>, char_t, adapter_t>> t;
-        t.v1 = x;
-        t.v2 = y;
-        auto tmp = Commute::commute1<char_t, adapter_t>(t);
-        if (!tmp.has_value) {
-            return Nothing();
+        std::vector<Named<Core_FP<char_t, adapter_t>, char_t, adapter_t>> ys1;
+        ys1.reserve(p.v2.size());
+        FL<Named<Core_FP<char_t, adapter_t>, char_t, adapter_t>> ys = p.v2;
+        while (ys != NilFL) {
+            Named<Core_FP<char_t, adapter_t>, char_t, adapter_t> y;
+            FL<Named<Core_FP<char_t, adapter_t>, char_t, adapter_t>> rest;
+            ys.extract(y, rest);
+            Tuple2<Named<Core_FP<char_t, adapter_t>, char_t, adapter_t>, Named<Core_FP<char_t, adapter_t>, char_t, adapter_t>> t;
+            t.v1 = x;
+            t.v2 = y;
+            auto tmp = cache ? cache->commute(t, Commute::commute1<char_t, adapter_t>) : Commute::commute1<char_t, adapter_t>(t);
+            if (!tmp.has_value) {
+                return Nothing();
+            }
+            ys1.push_back(tmp->v1);
+            x = tmp->v2;
+            ys = rest;
         }
-        auto y1 = tmp->v1;
-        auto x1 = tmp->v2;
-        Tuple2<Named<Core_FP<char_t, adapter_t>, char_t, adapter_t>, FL<Named<Core_FP<char_t, adapter_t>, char_t, adapter_t>>> t1;
-        t1.v1 = x1;
-        t1.v2 = ys;
-        auto tmp1 = commuterIdFL(t1);
-        if (!tmp1.has_value) {
-            return Nothing();
+        typename FL<Named<Core_FP<char_t, adapter_t>, char_t, adapter_t>>::Builder builder;
+        builder.reserve(ys1.size());
+        for (std::size_t i = ys1.size(); i-- > 0;) {
+            builder.push(ys1[i]);
         }
-        auto ys1 = tmp1->v1;
-        auto x2 = tmp1->v2;
-        return Tuple2<FL<Named<Core_FP<char_t, adapter_t>, char_t, adapter_t>>, Named<Core_FP<char_t, adapter_t>, char_t, adapter_t>>(ys1.push(y1), x2);
+        return Tuple2<FL<Named<Core_FP<char_t, adapter_t>, char_t, adapter_t>>, Named<Core_FP<char_t, adapter_t>, char_t, adapter_t>>(builder.freeze(), x);
     }
 
     template <
@@ -987,34 +1347,37 @@ namespace DarcsPatch {
         typename adapter_t,
         typename AdapterMustExtendBasicStringAdapter = typename std::enable_if<std::is_base_of<StringAdapter::BasicStringAdapter<char_t>, adapter_t>::value>::type
     >
-    Maybe<Tuple2<FL<Core_FP<char_t, adapter_t>>, Core_FP<char_t, adapter_t>>> commuterIdFL(const Tuple2<Core_FP<char_t, adapter_t>, FL<Core_FP<char_t, adapter_t>>> & p) {
+    Maybe<Tuple2<FL<Core_FP<char_t, adapter_t>>, Core_FP<char_t, adapter_t>>> commuterIdFL(const Tuple2<Core_FP<char_t, adapter_t>, FL<Core_FP<char_t, adapter_t>>> & p, CommuteCache<Core_FP<char_t, adapter_t>> * cache = nullptr) {
         if (DARCH_PATCH_DEBUG_LOGGING) std::cout << "commuterIdFL called with arguments p = " << p << "\n";
         if (p.v2 == NilFL) {
             return Tuple2<FL<Core_FP<char_t, adapter_t>>, Core_FP<char_t, adapter_t>>(p.v2, p.v1);
         }
+        // a loop, as in the Named overload above
         auto x = p.v1;
-        Core_FP<char_t, adapter_t> y;
-        FL<Core_FP<char_t, adapter_t>> ys;
-        p.v2.extract(y, ys);
-        Tuple2<Core_FP<char_t, adapter_t>, Core_FP<char_t, adapter_t>> t;
-        t.v1 = x;
-        t.v2 = y;
-        auto tmp = Commute::commute2<char_t, adapter_t>(t);
-        if (!tmp.has_value) {
-            return Nothing();
+        std::vector<Core_FP<char_t, adapter_t>> ys1;
+        ys1.reserve(p.v2.size());
+        FL<Core_FP<char_t, adapter_t>> ys = p.v2;
+        while (ys != NilFL) {
+            Core_FP<char_t, adapter_t> y;
+            FL<Core_FP<char_t, adapter_t>> rest;
+            ys.extract(y, rest);
+            Tuple2<Core_FP<char_t, adapter_t>, Core_FP<char_t, adapter_t>> t;
+            t.v1 = x;
+            t.v2 = y;
+            auto tmp = cache ? cache->commute(t, Commute::commute2<char_t, adapter_t>) : Commute::commute2<char_t, adapter_t>(t);
+            if (!tmp.has_value) {
+                return Nothing();
+            }
+            ys1.push_back(tmp->v1);
+            x = tmp->v2;
+            ys = rest;
         }
-        auto y1 = tmp->v1;
-        auto x1 = tmp->v2;
-        Tuple2<Core_FP<char_t, adapter_t>, FL<Core_FP<char_t, adapter_t>>> t1;
-        t1.v1 = x1;
-        t1.v2 = ys;
-        auto tmp1 = commuterIdFL(t1);
-        if (!tmp1.has_value) {
-            return Nothing();
+        typename FL<Core_FP<char_t, adapter_t>>::Builder builder;
+        builder.reserve(ys1.size());
+        for (std::size_t i = ys1.size(); i-- > 0;) {
+            builder.push(ys1[i]);
         }
-        auto ys1 = tmp1->v1;
-        auto x2 = tmp1->v2;
-        return Tuple2<FL<Core_FP<char_t, adapter_t>>, Core_FP<char_t, adapter_t>>(ys1.push(y1), x2);
+        return Tuple2<FL<Core_FP<char_t, adapter_t>>, Core_FP<char_t, adapter_t>>(builder.freeze(), x);
     }
 
     template <
@@ -1022,11 +1385,263 @@ namespace DarcsPatch {
         typename adapter_t,
         typename AdapterMustExtendBasicStringAdapter = typename std::enable_if<std::is_base_of<StringAdapter::BasicStringAdapter<char_t>, adapter_t>::value>::type
     >
-    Maybe<Tuple2<FL<Named<Core_FP<char_t, adapter_t>, char_t, adapter_t>>, Named<Core_FP<char_t, adapter_t>, char_t, adapter_t>>> commuteFL(const Tuple2<Named<Core_FP<char_t, adapter_t>, char_t, adapter_t>, FL<Named<Core_FP<char_t, adapter_t>, char_t, adapter_t>>> & p) {
+    Maybe<Tuple2<FL<Named<Core_FP<char_t, adapter_t>, char_t, adapter_t>>, Named<Core_FP<char_t, adapter_t>, char_t, adapter_t>>> commuteFL(const Tuple2<Named<Core_FP<char_t, adapter_t>, char_t, adapter_t>, FL<Named<Core_FP<char_t, adapter_t>, char_t, adapter_t>>> & p, CommuteCache<Named<Core_FP<char_t, adapter_t>, char_t, adapter_t>> * cache = nullptr) {
         if (DARCH_PATCH_DEBUG_LOGGING) std::cout << "commuterFL called with arguments p = " << p << "\n";
-        return commuterIdFL<char_t, adapter_t>(p);
+        return commuterIdFL<char_t, adapter_t>(p, cache);
     }
 
+    // a sequence of patches indexed by the files they change, so that a
+    // patch can be commuted past the whole sequence while only being
+    // commuted with the patches that share a file with it
+    //
+    // prims on different files always commute unchanged, so the result is
+    // the one commuteFL gives for the sequence. where a patch and an entry
+    // both change a file with one hunk each, they are commuted with the line
+    // arithmetic of commuteHunkLines alone and the entry keeps its new line
+    // numbers here, its hunks are only rebuilt when it next needs a full
+    // commute.
+    //
+    // the lines of an entry are relative to the state it applies to, which
+    // is a different one for each entry, so the entries of a file are kept
+    // in sequence order rather than ordered by their lines.
+    //
+    template <
+        typename char_t,
+        typename adapter_t,
+        typename AdapterMustExtendBasicStringAdapter = typename std::enable_if<std::is_base_of<StringAdapter::BasicStringAdapter<char_t>, adapter_t>::value>::type
+    >
+    class FileRangeIndex {
+        using NAMED = Named<Core_FP<char_t, adapter_t>, char_t, adapter_t>;
+        using PATH = AnchorPath<char_t, adapter_t>;
+        using INFO = PatchInfo<char_t, adapter_t>;
+
+        // how a patch changes one file, a lone hunk is tracked by its lines,
+        // anything else needs a full commute
+        struct Range {
+            PATH path;
+            bool hunk = false;
+            std::size_t line = 0;
+            std::size_t old_lines = 0;
+            std::size_t new_lines = 0;
+        };
+
+        // ranges are sorted by path, moved is set once the lines of a range
+        // no longer match the hunk in patch
+        struct Entry {
+            NAMED patch;
+            std::vector<Range> ranges;
+            bool moved = false;
+        };
+
+        struct Change {
+            std::size_t slot;
+            std::vector<Range> ranges;
+            bool commuted;
+            NAMED patch;
+        };
+
+        // the front of the sequence is the last entry
+        std::vector<Entry> entries;
+        // how many of the entries before each slot have prims
+        std::vector<std::size_t> with_prims_before = {0};
+        std::map<PATH, std::vector<std::size_t>> by_path;
+        std::map<INFO, std::vector<std::size_t>> by_name;
+        std::map<INFO, std::vector<std::size_t>> by_dependency;
+        CommuteCache<NAMED> * cache;
+
+        static std::vector<Range> ranges_of(const NAMED & patch) {
+            const auto summary = patch.touched();
+            std::vector<Range> ranges;
+            ranges.reserve(summary->files.size());
+            for (const auto & file : summary->files) {
+                Range range;
+                range.path = file.path;
+                if (file.lone_hunk()) {
+                    range.hunk = true;
+                    range.line = file.line;
+                    range.old_lines = file.old_lines;
+                    range.new_lines = file.new_lines;
+                }
+                ranges.push_back(range);
+            }
+            return ranges;
+        }
+
+        // patch with the hunks of moved ranges put at their current lines
+        static NAMED rebuild(const NAMED & patch, const std::vector<Range> & ranges) {
+            std::vector<Core_FP<char_t, adapter_t>> prims;
+            prims.reserve(patch.p.size());
+            for (const auto & prim : patch.p) {
+                auto range = std::lower_bound(ranges.begin(), ranges.end(), prim.anchor_path, [](const Range & a, const PATH & b) { return a.path < b; });
+                if (range != ranges.end() && range->hunk && range->path == prim.anchor_path) {
+                    auto * hunk = static_cast<const FileHunk<char_t, adapter_t> *>(prim.patch.get());
+                    if (hunk->line != range->line) {
+                        prims.emplace_back(prim.anchor_path, hunk->at_line(range->line));
+                        continue;
+                    }
+                }
+                prims.push_back(prim);
+            }
+            typename FL<Core_FP<char_t, adapter_t>>::Builder builder;
+            builder.reserve(prims.size());
+            for (std::size_t i = prims.size(); i-- > 0;) {
+                builder.push(prims[i]);
+            }
+            return NAMED(patch.n, patch.d, builder.freeze());
+        }
+
+        // commutes the lines of q past those of x where every file they
+        // share is changed by a lone hunk in both, UNKNOWN otherwise
+        static Commute::PERHAPHS_E commute_lines(std::vector<Range> & q, std::vector<Range> & x) {
+            for (std::size_t i = 0, j = 0; i < q.size() && j < x.size();) {
+                if (q[i].path < x[j].path) i++;
+                else if (x[j].path < q[i].path) j++;
+                else {
+                    if (!q[i].hunk || !x[j].hunk) return Commute::UNKNOWN;
+                    i++;
+                    j++;
+                }
+            }
+            for (std::size_t i = 0, j = 0; i < q.size() && j < x.size();) {
+                if (q[i].path < x[j].path) i++;
+                else if (x[j].path < q[i].path) j++;
+                else {
+                    Range & a = q[i++];
+                    Range & b = x[j++];
+                    // as in commuteFP, an empty hunk commutes with anything
+                    if ((b.old_lines == 0 && b.new_lines == 0) || (a.old_lines == 0 && a.new_lines == 0)) {
+                        continue;
+                    }
+                    auto m = Commute::commuteHunkLines(a.line, a.old_lines, a.new_lines, b.line, b.old_lines, b.new_lines);
+                    if (!m.has_value) {
+                        return Commute::FAILED;
+                    }
+                    b.line = m->v1;
+                    a.line = m->v2;
+                }
+            }
+            return Commute::SUCCEEDED;
+        }
+
+        public:
+
+        FileRangeIndex(CommuteCache<NAMED> * cache = nullptr) : cache(cache) {}
+
+        const std::size_t size() const {
+            return entries.size();
+        }
+
+        // puts p at the front of the sequence
+        void push(const NAMED & p) {
+            const std::size_t slot = entries.size();
+            entries.push_back({p, ranges_of(p), false});
+            with_prims_before.push_back(with_prims_before.back() + (p.p.size() != 0 ? 1 : 0));
+            for (const Range & range : entries.back().ranges) {
+                by_path[range.path].push_back(slot);
+            }
+            by_name[p.n].push_back(slot);
+            for (const auto & j : p.d) {
+                by_dependency[j].push_back(slot);
+            }
+        }
+
+        // commutes q, which comes before the sequence, past all of it and
+        // keeps the commuted sequence, false leaves the sequence as it was
+        //
+        // this is commuteFL (q :> sequence), the entries q shares no file
+        // with come through it unchanged and are skipped
+        //
+        bool commute(const NAMED & q) {
+            std::vector<std::size_t> candidates;
+            auto add = [&](const std::map<PATH, std::vector<std::size_t>> & index, const PATH & key) {
+                auto it = index.find(key);
+                if (it != index.end()) candidates.insert(candidates.end(), it->second.begin(), it->second.end());
+            };
+            std::vector<Range> q_ranges = ranges_of(q);
+            for (const Range & range : q_ranges) {
+                add(by_path, range.path);
+            }
+            // commute1 refuses to commute a patch with one that names the
+            // other in its dependencies
+            std::vector<std::size_t> refused;
+            for (const auto & j : q.d) {
+                auto it = by_name.find(j);
+                if (it != by_name.end()) refused.insert(refused.end(), it->second.begin(), it->second.end());
+            }
+            auto it = by_dependency.find(q.n);
+            if (it != by_dependency.end()) refused.insert(refused.end(), it->second.begin(), it->second.end());
+            std::sort(refused.begin(), refused.end());
+            candidates.insert(candidates.end(), refused.begin(), refused.end());
+
+            // front of the sequence first
+            std::sort(candidates.begin(), candidates.end(), std::greater<std::size_t>());
+            candidates.erase(std::unique(candidates.begin(), candidates.end()), candidates.end());
+
+            // q_patch is q as it comes out of the entries from slot
+            // q_passed on, q_moved is set once its lines have moved since
+            NAMED q_patch = q;
+            std::size_t q_passed = entries.size();
+            bool q_moved = false;
+            std::vector<Change> changes;
+            changes.reserve(candidates.size());
+            for (const std::size_t slot : candidates) {
+                if (std::binary_search(refused.begin(), refused.end(), slot)) {
+                    return false;
+                }
+                const Entry & x = entries[slot];
+                std::vector<Range> x_ranges = x.ranges;
+                auto r = commute_lines(q_ranges, x_ranges);
+                if (r == Commute::FAILED) {
+                    return false;
+                }
+                if (r == Commute::SUCCEEDED) {
+                    q_moved = true;
+                    changes.push_back({slot, std::move(x_ranges), false, {}});
+                    continue;
+                }
+                Tuple2<NAMED, NAMED> t;
+                t.v1 = q_moved ? rebuild(q_patch, q_ranges) : q_patch;
+                t.v2 = x.moved ? rebuild(x.patch, x.ranges) : x.patch;
+                // commute1 hands back the prims of the first patch in reverse
+                // order whenever both patches have prims, the skipped
+                // entries would have done so as well
+                if (q_patch.p.size() != 0 && (with_prims_before[q_passed] - with_prims_before[slot + 1]) % 2 == 1) {
+                    t.v1 = t.v1.reversed();
+                }
+                auto tmp = cache ? cache->commute(t, Commute::commute1<char_t, adapter_t>) : Commute::commute1<char_t, adapter_t>(t);
+                if (!tmp.has_value) {
+                    return false;
+                }
+                changes.push_back({slot, ranges_of(tmp->v1), true, tmp->v1});
+                q_patch = tmp->v2;
+                q_passed = slot;
+                q_ranges = ranges_of(q_patch);
+                q_moved = false;
+            }
+            for (Change & change : changes) {
+                Entry & x = entries[change.slot];
+                x.ranges = std::move(change.ranges);
+                if (change.commuted) {
+                    x.patch = std::move(change.patch);
+                    x.moved = false;
+                } else {
+                    x.moved = true;
+                }
+            }
+            return true;
+        }
+
+        // the sequence, front first
+        FL<NAMED> sequence() const {
+            typename FL<NAMED>::Builder builder;
+            builder.reserve(entries.size());
+            for (const Entry & x : entries) {
+                builder.push(x.moved ? rebuild(x.patch, x.ranges) : x.patch);
+            }
+            return builder.freeze();
+        }
+    };
+
     template <
         typename char_t,
         typename adapter_t,
@@ -4,6 +4,10 @@
 #include "darcs_types.h"
 #include "darcs_commute.h"
 
+#include <condition_variable>
+#include <exception>
+#include <thread>
+
 namespace DarcsPatch {
     /*
     ```
@@ -47,9 +51,9 @@ namespace DarcsPatch {
         typename adapter_t,
         typename AdapterMustExtendBasicStringAdapter = typename std::enable_if<std::is_base_of<StringAdapter::BasicStringAdapter<char_t>, adapter_t>::value>::type
     >
-    Set<PatchInfo<char_t, adapter_t>> allDeps(const PatchInfo<char_t, adapter_t> & j, const LazyValue<DepsGraph<char_t, adapter_t>> & m) {
-        if (DARCH_PATCH_DEBUG_LOGGING) std::cout << "called allDeps with arguments j = " << j << ", m = " << m() << "\n";
-        Maybe<Deps<char_t, adapter_t>> sets = m().lookup(j);
+    PatchSet<char_t, adapter_t> allDeps(const PatchInfo<char_t, adapter_t> & j, const DepsGraph<char_t, adapter_t> & m) {
+        if (DARCH_PATCH_DEBUG_LOGGING) std::cout << "called allDeps with arguments j = " << j << ", m = " << m << "\n";
+        Maybe<Deps<char_t, adapter_t>> sets = m.lookup(j);
         if (DARCH_PATCH_DEBUG_LOGGING) std::cout << "m.lookup(j) = " << sets << "\n";
         return sets->v1.Union(sets->v2);
     }
@@ -59,123 +63,469 @@ namespace DarcsPatch {
         typename adapter_t,
         typename AdapterMustExtendBasicStringAdapter = typename std::enable_if<std::is_base_of<StringAdapter::BasicStringAdapter<char_t>, adapter_t>::value>::type
     >
-    Set<PatchInfo<char_t, adapter_t>> addDeps(const PatchInfo<char_t, adapter_t> & j, const Set<PatchInfo<char_t, adapter_t>> & indirect, const LazyValue<DepsGraph<char_t, adapter_t>> & m) {
+    PatchSet<char_t, adapter_t> addDeps(const PatchInfo<char_t, adapter_t> & j, const PatchSet<char_t, adapter_t> & indirect, const DepsGraph<char_t, adapter_t> & m) {
         if (DARCH_PATCH_DEBUG_LOGGING) std::cout << "called addDeps with arguments j = " << j << ", indirect = " << indirect << "\n";
         return allDeps(j, m).Union(indirect).insert(j);
     }
 
+    // addDeps with the entry of j already looked up
     template <
         typename char_t,
         typename adapter_t,
         typename AdapterMustExtendBasicStringAdapter = typename std::enable_if<std::is_base_of<StringAdapter::BasicStringAdapter<char_t>, adapter_t>::value>::type
     >
-    const LazyValue<Deps<char_t, adapter_t>> foldDeps(
-        const RL<Named<Core_FP<char_t, adapter_t>, char_t, adapter_t>> & p,
-        const FL<Named<Core_FP<char_t, adapter_t>, char_t, adapter_t>> & p_and_deps,
-        const FL<Named<Core_FP<char_t, adapter_t>, char_t, adapter_t>> & non_deps,
-        const LazyValue<Deps<char_t, adapter_t>> & acc,
-        const LazyValue<DepsGraph<char_t, adapter_t>> & m
+    PatchSet<char_t, adapter_t> addDeps(const PatchInfo<char_t, adapter_t> & j, const PatchSet<char_t, adapter_t> & indirect, const Deps<char_t, adapter_t> & sets) {
+        return sets.v1.Union(sets.v2).Union(indirect).insert(j);
+    }
+
+    // foldDeps as a loop, p is folded back over the first `count` patches of
+    // ps from the newest to the oldest. deps_of(j) gives the entry of an
+    // earlier patch j and `known` is how many distinct patches those are
+    //
+    // the non_deps list of the recursive version is never read so it is not
+    // kept, and once every earlier patch is an indirect dep the rest of the
+    // fold could only push onto p_and_deps, so it stops there
+    //
+    template <
+        typename char_t,
+        typename adapter_t,
+        typename DEPS_OF,
+        typename AdapterMustExtendBasicStringAdapter = typename std::enable_if<std::is_base_of<StringAdapter::BasicStringAdapter<char_t>, adapter_t>::value>::type
+    >
+    Deps<char_t, adapter_t> foldDepsWith(
+        const RL<Named<Core_FP<char_t, adapter_t>, char_t, adapter_t>> & ps,
+        const std::size_t count,
+        const Named<Core_FP<char_t, adapter_t>, char_t, adapter_t> & p,
+        const std::size_t known,
+        const DEPS_OF & deps_of,
+        const std::shared_ptr<const PatchIndex<char_t, adapter_t>> & index,
+        NamedCommuteCache<char_t, adapter_t> * cache = nullptr
     ) {
-        if (DARCH_PATCH_DEBUG_LOGGING) {
-            std::cout << "foldDeps called with arguments p = " << p << ", p_and_deps = " << p_and_deps << ", non_deps = " << non_deps << "\n";
-            puts("FOLD_DEPS ENTER");
-        }
-        if (p == NilRL) {
-            if (DARCH_PATCH_DEBUG_LOGGING) {
-                puts("FOLD_DEPS NILRL");
-                puts("FOLD_DEPS EXIT");
+        if (DARCH_PATCH_DEBUG_LOGGING) std::cout << "foldDeps called with arguments count = " << count << ", p = " << p << "\n";
+
+        FileRangeIndex<char_t, adapter_t> p_and_deps(cache);
+        p_and_deps.push(p);
+        Deps<char_t, adapter_t> acc(index, index);
+
+        // acc.v2 only ever holds earlier patches
+        for (std::size_t i = count; i-- > 0 && acc.v2.size() != known;) {
+            const Named<Core_FP<char_t, adapter_t>, char_t, adapter_t> & q = ps[i];
+            PatchInfo<char_t, adapter_t> j = ident(q);
+            if (DARCH_PATCH_DEBUG_LOGGING) std::cout << "\n\nq = " << q << "\n\np_and_deps = " << p_and_deps.sequence() << "\n\n\n";
+
+            if (acc.v2.contains(j)) {
+                if (DARCH_PATCH_DEBUG_LOGGING) puts("FOLD_DEPS INDIRECT CONTAINS J");
+                p_and_deps.push(q);
+                continue;
+            }
+
+            // commuteFL (q :> p_and_deps), only commuting q with the patches
+            // it shares a file with
+            if (!p_and_deps.commute(q)) {
+                p_and_deps.push(q);
+                acc = Deps<char_t, adapter_t>(acc.v1.insert(j), addDeps<char_t, adapter_t>(j, acc.v2, deps_of(j)));
             }
-            return acc;
         }
 
-        if (DARCH_PATCH_DEBUG_LOGGING) puts("FOLD_DEPS NON NILRL");
+        if (DARCH_PATCH_DEBUG_LOGGING) std::cout << "returning from foldDeps with acc = " << acc << "\n";
+        return acc;
+    }
 
-        Named<Core_FP<char_t, adapter_t>, char_t, adapter_t> q;
-        RL<Named<Core_FP<char_t, adapter_t>, char_t, adapter_t>> qs;
-        p.extract(q, qs);
+    // m must hold the deps of each of the first `count` patches of ps
+    template <
+        typename char_t,
+        typename adapter_t,
+        typename AdapterMustExtendBasicStringAdapter = typename std::enable_if<std::is_base_of<StringAdapter::BasicStringAdapter<char_t>, adapter_t>::value>::type
+    >
+    Deps<char_t, adapter_t> foldDeps(
+        const RL<Named<Core_FP<char_t, adapter_t>, char_t, adapter_t>> & ps,
+        const std::size_t count,
+        const Named<Core_FP<char_t, adapter_t>, char_t, adapter_t> & p,
+        const DepsGraph<char_t, adapter_t> & m,
+        const std::shared_ptr<const PatchIndex<char_t, adapter_t>> & index,
+        NamedCommuteCache<char_t, adapter_t> * cache = nullptr
+    ) {
+        auto deps_of = [&m](const PatchInfo<char_t, adapter_t> & j) -> const Deps<char_t, adapter_t> & {
+            return m.map.get(j)->second;
+        };
+        return foldDepsWith<char_t, adapter_t>(ps, count, p, m.size(), deps_of, index, cache);
+    }
+
+    // the patches of a history split into shards, patches in different
+    // shards touch no common file, have different idents and do not name
+    // each other in `d`, so they always commute
+    //
+    // folding a patch only ever keeps patches of its own shard in
+    // p_and_deps, so it can be folded over the earlier patches of its shard
+    // alone. a Named patch touching several files joins their shards.
+    //
+    template <
+        typename char_t,
+        typename adapter_t,
+        typename AdapterMustExtendBasicStringAdapter = typename std::enable_if<std::is_base_of<StringAdapter::BasicStringAdapter<char_t>, adapter_t>::value>::type
+    >
+    struct PatchShards {
+        // each in patch order
+        std::vector<RL<Named<Core_FP<char_t, adapter_t>, char_t, adapter_t>>> shards;
+        // the shard of each patch
+        std::vector<std::size_t> shard_of;
+    };
 
-        if (DARCH_PATCH_DEBUG_LOGGING) puts("FOLD_DEPS IDENT");
-        PatchInfo<char_t, adapter_t> j = ident(q);
-        if (DARCH_PATCH_DEBUG_LOGGING) std::cout << "foldDeps called with arguments q = " << q << ", qs = " << qs << ", j = " << j << "\n";
+    // index must number every ident of ps
+    template <
+        typename char_t,
+        typename adapter_t,
+        typename AdapterMustExtendBasicStringAdapter = typename std::enable_if<std::is_base_of<StringAdapter::BasicStringAdapter<char_t>, adapter_t>::value>::type
+    >
+    PatchShards<char_t, adapter_t> shardByFile(const RL<Named<Core_FP<char_t, adapter_t>, char_t, adapter_t>> & ps, const std::shared_ptr<const PatchIndex<char_t, adapter_t>> & index) {
+        using INDEX = PatchIndex<char_t, adapter_t>;
 
-        if (DARCH_PATCH_DEBUG_LOGGING) std::cout << "\n\nq = " << q << "\n\np_and_deps = " << p_and_deps << "\n\n\n";
+        // a union find over the ids of idents followed by one id per file
+        std::vector<std::size_t> parent(index->size());
+        for (std::size_t i = 0; i < parent.size(); i++) {
+            parent[i] = i;
+        }
+        auto find = [&parent](std::size_t i) {
+            while (parent[i] != i) {
+                parent[i] = parent[parent[i]];
+                i = parent[i];
+            }
+            return i;
+        };
+        auto join = [&](const std::size_t a, const std::size_t b) {
+            const std::size_t ra = find(a);
+            const std::size_t rb = find(b);
+            if (ra != rb) {
+                parent[std::max(ra, rb)] = std::min(ra, rb);
+            }
+        };
+
+        // by interned path id
+        std::unordered_map<std::uint32_t, std::size_t> files;
+        for (const auto & p : ps) {
+            const std::size_t id = index->id_of(p.n);
+            for (const auto & prim : p.p) {
+                auto file = files.find(prim.anchor_path.id);
+                if (file == files.end()) {
+                    file = files.emplace(prim.anchor_path.id, parent.size()).first;
+                    parent.push_back(parent.size());
+                }
+                join(id, file->second);
+            }
+            // a dependency on a patch outside ps can not stop a commute
+            for (const auto & j : p.d) {
+                const uint32_t dep = index->id_of(j);
+                if (dep != INDEX::NOT_FOUND) {
+                    join(id, dep);
+                }
+            }
+        }
 
-        if (acc().v2.contains(j)) {
-            if (DARCH_PATCH_DEBUG_LOGGING) puts("FOLD_DEPS INDIRECT CONTAINS J");
-            return foldDeps<char_t, adapter_t>(qs, p_and_deps.push(q), non_deps, acc, m);
+        PatchShards<char_t, adapter_t> result;
+        result.shard_of.reserve(ps.size());
+        std::vector<std::size_t> shard_of_root(parent.size(), ps.size());
+        std::size_t count = 0;
+        for (const auto & p : ps) {
+            std::size_t & shard = shard_of_root[find(index->id_of(p.n))];
+            if (shard == ps.size()) {
+                shard = count++;
+            }
+            result.shard_of.push_back(shard);
+        }
+        if (count == 1) {
+            result.shards.push_back(ps);
+            return result;
+        }
+        std::vector<typename RL<Named<Core_FP<char_t, adapter_t>, char_t, adapter_t>>::Builder> builders(count);
+        std::size_t k = 0;
+        for (const auto & p : ps) {
+            builders[result.shard_of[k++]].push(p);
+        }
+        result.shards.reserve(count);
+        for (auto & builder : builders) {
+            result.shards.push_back(builder.freeze());
         }
+        return result;
+    }
 
-        if (DARCH_PATCH_DEBUG_LOGGING) std::cout << "calling commuteFL with arguments q = " << q << ", p_and_deps = " << p_and_deps << "\n";
-        auto tmp = commuteFL<char_t, adapter_t>({q, p_and_deps});
-        if (tmp.has_value) {
-            auto r = foldDeps<char_t, adapter_t>(qs, tmp->v1, non_deps.push(tmp->v2), acc, m);
-            if (DARCH_PATCH_DEBUG_LOGGING) puts("FOLD_DEPS EXIT");
-            return r;
-        } else {
-            auto r = foldDeps<char_t, adapter_t>(qs, p_and_deps.push(q), non_deps, LazyValue<Deps<char_t, adapter_t>>([=]() {
-                auto acc_ = acc();
-                return Deps<char_t, adapter_t>(acc_.v1.insert(j), addDeps<char_t, adapter_t>(j, acc_.v2, m));
-            }), m);
-            if (DARCH_PATCH_DEBUG_LOGGING) puts("FOLD_DEPS EXIT");
-            return r;
+    // built bottom up, oldest patch first, each patch is folded over the ones
+    // before it in its shard with the graph of those, so neither the stack
+    // nor the number of live closures grows with the length of ps
+    template <
+        typename char_t,
+        typename adapter_t,
+        typename AdapterMustExtendBasicStringAdapter = typename std::enable_if<std::is_base_of<StringAdapter::BasicStringAdapter<char_t>, adapter_t>::value>::type
+    >
+    DepsGraph<char_t, adapter_t> depsGraph(const RL<Named<Core_FP<char_t, adapter_t>, char_t, adapter_t>> & ps, const std::shared_ptr<const PatchIndex<char_t, adapter_t>> & index, NamedCommuteCache<char_t, adapter_t> * cache = nullptr) {
+        if (DARCH_PATCH_DEBUG_LOGGING) std::cout << "depsGraph called with arguments ps = " << ps << "\n";
+        const auto sharded = shardByFile<char_t, adapter_t>(ps, index);
+        DepsGraph<char_t, adapter_t> m;
+        auto deps_of = [&m](const PatchInfo<char_t, adapter_t> & j) -> const Deps<char_t, adapter_t> & {
+            return m.map.get(j)->second;
+        };
+        // how many patches of each shard have been folded, and how many
+        // distinct idents they have
+        std::vector<std::size_t> count(sharded.shards.size());
+        std::vector<std::size_t> known(sharded.shards.size());
+        std::size_t k = 0;
+        for (const auto & p : ps) {
+            const std::size_t shard = sharded.shard_of[k++];
+            auto folded = foldDepsWith<char_t, adapter_t>(sharded.shards[shard], count[shard], p, known[shard], deps_of, index, cache);
+            const std::size_t size = m.size();
+            m.insert_in_place(ident(p), folded);
+            known[shard] += m.size() - size;
+            count[shard]++;
         }
+        if (DARCH_PATCH_DEBUG_LOGGING) std::cout << "returning from depsGraph with m = " << m << "\n";
+        return m;
+    }
 
-        if (DARCH_PATCH_DEBUG_LOGGING) puts("FOLD_DEPS EXIT");
-        return acc;
+    // how many threads depsGraph may fold patches on, 0 is one per core
+    struct ParallelOptions {
+        std::size_t threads = 0;
     };
 
+    // depsGraph of a history with several shards on a pool of threads that
+    // take the next shard, largest first, and fold it as the serial version
+    // does. the shards touch disjoint files and share no entries, so their
+    // graphs are simply merged, and when folds throw, the exception of the
+    // oldest patch is rethrown
     template <
         typename char_t,
         typename adapter_t,
         typename AdapterMustExtendBasicStringAdapter = typename std::enable_if<std::is_base_of<StringAdapter::BasicStringAdapter<char_t>, adapter_t>::value>::type
     >
-    LazyValue<DepsGraph<char_t, adapter_t>> depsGraph_lazy(const RL<Named<Core_FP<char_t, adapter_t>, char_t, adapter_t>> ps_) {
-        if (DARCH_PATCH_DEBUG_LOGGING) {
-            std::cout << "depsGraph called with arguments ps_ = " << ps_ << "\n";
-            puts("DEPS_GRAPH ENTER");
+    DepsGraph<char_t, adapter_t> depsGraphOfShards(const PatchShards<char_t, adapter_t> & sharded, const std::shared_ptr<const PatchIndex<char_t, adapter_t>> & index, const std::size_t threads, NamedCommuteCache<char_t, adapter_t> * cache = nullptr) {
+        const std::size_t n = sharded.shard_of.size();
+        const std::size_t count = sharded.shards.size();
+
+        // where the patches of each shard are in the history
+        std::vector<std::vector<std::size_t>> positions(count);
+        for (std::size_t k = 0; k < n; k++) {
+            positions[sharded.shard_of[k]].push_back(k);
         }
+        std::vector<std::size_t> order(count);
+        for (std::size_t i = 0; i < count; i++) {
+            order[i] = i;
+        }
+        std::stable_sort(order.begin(), order.end(), [&](std::size_t a, std::size_t b) {
+            return sharded.shards[a].size() > sharded.shards[b].size();
+        });
 
-        if (ps_ == NilRL) {
-            if (DARCH_PATCH_DEBUG_LOGGING) {
-                puts("DEPS_GRAPH NILRL");
-                puts("DEPS_GRAPH EXIT");
+        std::vector<DepsGraph<char_t, adapter_t>> graphs(count);
+        std::vector<std::exception_ptr> errors(count);
+        std::atomic<std::size_t> next { 0 };
+        std::atomic<std::size_t> failed_at { n };
+
+        auto work = [&] {
+            for (std::size_t i = next++; i < count; i = next++) {
+                const std::size_t shard = order[i];
+                const auto & ps = sharded.shards[shard];
+                DepsGraph<char_t, adapter_t> & m = graphs[shard];
+                auto deps_of = [&m](const PatchInfo<char_t, adapter_t> & j) -> const Deps<char_t, adapter_t> & {
+                    return m.map.get(j)->second;
+                };
+                std::size_t folded_count = 0;
+                std::size_t known = 0;
+                for (const auto & p : ps) {
+                    const std::size_t at = positions[shard][folded_count];
+                    // nothing after a patch that threw counts
+                    if (at > failed_at.load()) {
+                        break;
+                    }
+                    try {
+                        auto folded = foldDepsWith<char_t, adapter_t>(ps, folded_count, p, known, deps_of, index, cache);
+                        const std::size_t size = m.size();
+                        m.insert_in_place(ident(p), folded);
+                        known += m.size() - size;
+                    } catch (...) {
+                        errors[shard] = std::current_exception();
+                        std::size_t failed = failed_at.load();
+                        while (at < failed && !failed_at.compare_exchange_weak(failed, at)) {}
+                        break;
+                    }
+                    folded_count++;
+                }
             }
-            return LazyValue<DepsGraph<char_t, adapter_t>>([]() { return DepsGraph<char_t, adapter_t>(); });
+        };
+
+        std::vector<std::thread> pool;
+        const std::size_t workers = std::min(threads, count);
+        pool.reserve(workers - 1);
+        for (std::size_t i = 1; i < workers; i++) {
+            pool.emplace_back(work);
+        }
+        work();
+        for (auto & thread : pool) {
+            thread.join();
         }
 
-        if (DARCH_PATCH_DEBUG_LOGGING) puts("DEPS_GRAPH NON NILRL");
+        if (failed_at.load() < n) {
+            std::rethrow_exception(errors[sharded.shard_of[failed_at.load()]]);
+        }
+        DepsGraph<char_t, adapter_t> m;
+        for (const auto & graph : graphs) {
+            for (const auto & entry : graph) {
+                m.insert_in_place(entry.first, entry.second);
+            }
+        }
+        return m;
+    }
 
-        Named<Core_FP<char_t, adapter_t>, char_t, adapter_t> p;
-        RL<Named<Core_FP<char_t, adapter_t>, char_t, adapter_t>> ps;
-        ps_.extract(p, ps);
+    // depsGraph on a pool of threads, a history with several shards is
+    // folded a shard per thread as above. one shard is folded by threads
+    // that take the next patch, oldest first, whenever they are free
+    //
+    // a fold only waits for the entry of an earlier patch it cannot commute
+    // past, and that patch was taken before it so the wait always ends. the
+    // graph is put together in patch order afterwards, so it is the same as
+    // the serial one, and when folds throw, the exception of the oldest
+    // patch is rethrown as the serial version would have thrown it
+    //
+    template <
+        typename char_t,
+        typename adapter_t,
+        typename AdapterMustExtendBasicStringAdapter = typename std::enable_if<std::is_base_of<StringAdapter::BasicStringAdapter<char_t>, adapter_t>::value>::type
+    >
+    DepsGraph<char_t, adapter_t> depsGraph(const RL<Named<Core_FP<char_t, adapter_t>, char_t, adapter_t>> & ps, const std::shared_ptr<const PatchIndex<char_t, adapter_t>> & index, const ParallelOptions & options, NamedCommuteCache<char_t, adapter_t> * cache = nullptr) {
+        const std::size_t n = ps.size();
+        std::size_t threads = options.threads != 0 ? options.threads : std::thread::hardware_concurrency();
+        if (threads <= 1 || n < 2) {
+            return depsGraph<char_t, adapter_t>(ps, index, cache);
+        }
+        const auto sharded = shardByFile<char_t, adapter_t>(ps, index);
+        if (sharded.shards.size() > 1) {
+            return depsGraphOfShards<char_t, adapter_t>(sharded, index, threads, cache);
+        }
+        threads = std::min(threads, n);
+
+        // the graph keeps the entry of the first patch with each ident
+        std::vector<const Named<Core_FP<char_t, adapter_t>, char_t, adapter_t> *> patches;
+        std::vector<std::size_t> first(index->size(), n);
+        std::vector<std::size_t> known(n);
+        patches.reserve(n);
+        std::size_t distinct = 0;
+        for (const auto & p : ps) {
+            const std::size_t k = patches.size();
+            patches.push_back(&p);
+            known[k] = distinct;
+            std::size_t & f = first[index->id_of(p.n)];
+            if (f == n) {
+                f = k;
+                distinct++;
+            }
+        }
 
-        if (DARCH_PATCH_DEBUG_LOGGING) puts("DEPS_GRAPH DEPS GRAPH");
-        LazyValue<DepsGraph<char_t, adapter_t>> m = depsGraph_lazy<char_t, adapter_t>(ps);
-        if (DARCH_PATCH_DEBUG_LOGGING) puts("DEPS_GRAPH IDENT");
-        PatchInfo<char_t, adapter_t> j2 = ident(p);
+        enum { PENDING, DONE, FAILED };
+        struct Slot {
+            std::atomic<int> state { PENDING };
+            Deps<char_t, adapter_t> deps;
+            std::exception_ptr error;
+        };
+        struct Abandoned {};
+
+        std::vector<Slot> slots(n);
+        std::mutex mutex;
+        std::condition_variable published;
+        std::atomic<std::size_t> next { 0 };
+        std::atomic<std::size_t> failed_at { n };
+
+        auto deps_of = [&](const PatchInfo<char_t, adapter_t> & j) -> const Deps<char_t, adapter_t> & {
+            Slot & slot = slots[first[index->id_of(j)]];
+            if (slot.state.load(std::memory_order_acquire) == PENDING) {
+                std::unique_lock<std::mutex> lock(mutex);
+                published.wait(lock, [&slot] { return slot.state.load(std::memory_order_acquire) != PENDING; });
+            }
+            // the patch this fold depends on threw, nothing after it counts
+            if (slot.state.load(std::memory_order_acquire) != DONE) {
+                throw Abandoned();
+            }
+            return slot.deps;
+        };
+
+        auto work = [&] {
+            for (std::size_t k = next++; k < n; k = next++) {
+                int state = FAILED;
+                // patches after one that threw are skipped but still published
+                if (k < failed_at.load()) {
+                    try {
+                        auto folded = foldDepsWith<char_t, adapter_t>(ps, k, *patches[k], known[k], deps_of, index, cache);
+                        if (first[index->id_of(patches[k]->n)] == k) {
+                            slots[k].deps = std::move(folded);
+                        }
+                        state = DONE;
+                    } catch (const Abandoned &) {
+                    } catch (...) {
+                        slots[k].error = std::current_exception();
+                        std::size_t at = failed_at.load();
+                        while (k < at && !failed_at.compare_exchange_weak(at, k)) {}
+                    }
+                }
+                {
+                    std::lock_guard<std::mutex> lock(mutex);
+                    slots[k].state.store(state, std::memory_order_release);
+                }
+                published.notify_all();
+            }
+        };
 
-        if (DARCH_PATCH_DEBUG_LOGGING) {
-            puts("DEPS_GRAPH FOLD DEPS");
-            std::cout << "calling FoldDeps with arguments p = " << p << "\n";
-            std::cout << "calling FoldDeps with arguments ps = " << ps << "\n";
+        std::vector<std::thread> pool;
+        pool.reserve(threads - 1);
+        for (std::size_t i = 1; i < threads; i++) {
+            pool.emplace_back(work);
+        }
+        work();
+        for (auto & thread : pool) {
+            thread.join();
         }
-        auto folded = foldDeps<char_t, adapter_t>(ps, NilFL.push(p), NilFL, LazyValue<Deps<char_t, adapter_t>>([](){ return Deps<char_t, adapter_t>(); }), m);
 
-        if (DARCH_PATCH_DEBUG_LOGGING) puts("DEPS_GRAPH INSERT");
+        if (failed_at.load() < n) {
+            std::rethrow_exception(slots[failed_at.load()].error);
+        }
+        DepsGraph<char_t, adapter_t> m;
+        for (std::size_t k = 0; k < n; k++) {
+            m.insert_in_place(patches[k]->n, slots[k].deps);
+        }
+        return m;
+    }
 
-        return LazyValue<DepsGraph<char_t, adapter_t>>([=]() {
-            if (DARCH_PATCH_DEBUG_LOGGING) {
-                std::cout << "map m = " << m() << "\n";
-                std::cout << "inserting key j1 = " << j2 << "\n";
-                std::cout << "inserting value folded = " << folded() << "\n";
-            }
-            auto m1 = m().insert(j2, folded());
-            if (DARCH_PATCH_DEBUG_LOGGING) {
-                std::cout << "returning from depsGraph with m1 = " << m1 << "\n";
-                puts("DEPS_GRAPH EXIT");
-            }
-            return m1;
-        });
+    template <
+        typename char_t,
+        typename adapter_t,
+        typename AdapterMustExtendBasicStringAdapter = typename std::enable_if<std::is_base_of<StringAdapter::BasicStringAdapter<char_t>, adapter_t>::value>::type
+    >
+    LazyValue<DepsGraph<char_t, adapter_t>> depsGraph_lazy(const RL<Named<Core_FP<char_t, adapter_t>, char_t, adapter_t>> ps_, const std::shared_ptr<const PatchIndex<char_t, adapter_t>> & index) {
+        return LazyValue<DepsGraph<char_t, adapter_t>>([=]() { return depsGraph<char_t, adapter_t>(ps_, index); });
+    }
+
+    // numbers the patches of ps in PatchInfo order
+    template <
+        typename char_t,
+        typename adapter_t,
+        typename AdapterMustExtendBasicStringAdapter = typename std::enable_if<std::is_base_of<StringAdapter::BasicStringAdapter<char_t>, adapter_t>::value>::type
+    >
+    std::shared_ptr<const PatchIndex<char_t, adapter_t>> makePatchIndex(const RL<Named<Core_FP<char_t, adapter_t>, char_t, adapter_t>> & ps) {
+        // sorts pointers to the idents so a long history is not copied
+        std::vector<const PatchInfo<char_t, adapter_t> *> infos;
+        infos.reserve(ps.size());
+        for (auto & p : ps) {
+            infos.push_back(&p.n);
+        }
+        std::sort(infos.begin(), infos.end(), [](auto * a, auto * b) { return *a < *b; });
+        auto index = std::make_shared<PatchIndex<char_t, adapter_t>>();
+        for (auto * info : infos) {
+            index->add(*info);
+        }
+        return index;
+    }
+
+    template <
+        typename char_t,
+        typename adapter_t,
+        typename AdapterMustExtendBasicStringAdapter = typename std::enable_if<std::is_base_of<StringAdapter::BasicStringAdapter<char_t>, adapter_t>::value>::type
+    >
+    LazyValue<DepsGraph<char_t, adapter_t>> depsGraph_lazy(const RL<Named<Core_FP<char_t, adapter_t>, char_t, adapter_t>> ps_) {
+        return depsGraph_lazy<char_t, adapter_t>(ps_, makePatchIndex<char_t, adapter_t>(ps_));
     }
 
     template <
@@ -184,12 +534,91 @@ namespace DarcsPatch {
         typename AdapterMustExtendBasicStringAdapter = typename std::enable_if<std::is_base_of<StringAdapter::BasicStringAdapter<char_t>, adapter_t>::value>::type
     >
     DepsGraph<char_t, adapter_t> depsGraph(const RL<Named<Core_FP<char_t, adapter_t>, char_t, adapter_t>> ps) {
-        return depsGraph_lazy<char_t, adapter_t>(ps)();
+        return depsGraph<char_t, adapter_t>(ps, makePatchIndex<char_t, adapter_t>(ps));
+    }
+
+    template <
+        typename char_t,
+        typename adapter_t,
+        typename AdapterMustExtendBasicStringAdapter = typename std::enable_if<std::is_base_of<StringAdapter::BasicStringAdapter<char_t>, adapter_t>::value>::type
+    >
+    DepsGraph<char_t, adapter_t> depsGraph(const RL<Named<Core_FP<char_t, adapter_t>, char_t, adapter_t>> ps, const ParallelOptions & options) {
+        return depsGraph<char_t, adapter_t>(ps, makePatchIndex<char_t, adapter_t>(ps), options);
+    }
+
+    // the graph of ps.push(new_ps) from g, the graph of ps, folding only the
+    // patches of new_ps and keeping every entry of g
+    //
+    // new patches usually sort after every patch of g, their ids are then
+    // put on an index that extends the one of g so its sets stay as they
+    // are. otherwise, or once indexes have been extended a few times, the
+    // sets of g are renumbered on a new index, which costs no commutes
+    template <
+        typename char_t,
+        typename adapter_t,
+        typename AdapterMustExtendBasicStringAdapter = typename std::enable_if<std::is_base_of<StringAdapter::BasicStringAdapter<char_t>, adapter_t>::value>::type
+    >
+    DepsGraph<char_t, adapter_t> extendDepsGraph(const DepsGraph<char_t, adapter_t> & g, const RL<Named<Core_FP<char_t, adapter_t>, char_t, adapter_t>> & ps, const RL<Named<Core_FP<char_t, adapter_t>, char_t, adapter_t>> & new_ps, NamedCommuteCache<char_t, adapter_t> * cache = nullptr) {
+        using INDEX = PatchIndex<char_t, adapter_t>;
+        const auto all = ps.push(new_ps);
+        if (g.size() == 0) {
+            return depsGraph<char_t, adapter_t>(all, makePatchIndex<char_t, adapter_t>(all), cache);
+        }
+
+        // entries folded before an extension keep the index they were made
+        // on, the latest one has the most patches
+        std::shared_ptr<const INDEX> old_index = g.cbegin()->second.v1.index;
+        for (const auto & entry : g) {
+            if (entry.second.v1.index->size() > old_index->size()) {
+                old_index = entry.second.v1.index;
+            }
+        }
+        std::vector<const PatchInfo<char_t, adapter_t> *> added;
+        for (auto & p : new_ps) {
+            if (old_index->id_of(p.n) == INDEX::NOT_FOUND) {
+                added.push_back(&p.n);
+            }
+        }
+        std::sort(added.begin(), added.end(), [](auto * a, auto * b) { return *a < *b; });
+
+        std::shared_ptr<const INDEX> index = old_index;
+        DepsGraph<char_t, adapter_t> m;
+        if (added.empty()) {
+            m = g;
+        } else if (old_index->depth < 8 && (*old_index)[old_index->size() - 1] < *added.front()) {
+            auto extended = std::make_shared<INDEX>(old_index);
+            for (auto * info : added) {
+                extended->add(*info);
+            }
+            index = extended;
+            m = g;
+        } else {
+            index = makePatchIndex<char_t, adapter_t>(all);
+            for (const auto & entry : g) {
+                m.insert_in_place(entry.first, Deps<char_t, adapter_t>(entry.second.v1.renumbered(index), entry.second.v2.renumbered(index)));
+            }
+        }
+
+        std::size_t count = ps.size();
+        for (const auto & p : new_ps) {
+            auto folded = foldDeps<char_t, adapter_t>(all, count, p, m, index, cache);
+            m.insert_in_place(ident(p), folded);
+            count++;
+        }
+        return m;
     }
 
     DepsGraph_T depsGraph_T(const RL<Named_T<Core_FP_T>> ps) {
         return depsGraph<char, StringAdapter::CharAdapter>(ps);
     }
+
+    DepsGraph_T depsGraph_T(const RL<Named_T<Core_FP_T>> ps, const ParallelOptions & options) {
+        return depsGraph<char, StringAdapter::CharAdapter>(ps, options);
+    }
+
+    DepsGraph_T extendDepsGraph_T(const DepsGraph_T & g, const RL<Named_T<Core_FP_T>> & ps, const RL<Named_T<Core_FP_T>> & new_ps) {
+        return extendDepsGraph<char, StringAdapter::CharAdapter>(g, ps, new_ps);
+    }
 }
 
 #endif
\ No newline at end of file
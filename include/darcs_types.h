@@ -9,11 +9,24 @@
 #include <iostream>
 #include <vector>
 #include <set>
+#include <unordered_set>
 #include <map>
+#include <unordered_map>
+#include <cstdint>
+#include <string>
+#include <limits>
 #include <memory>
+#include <atomic>
+#include <mutex>
 
 #define DARCH_PATCH_DEBUG_LOGGING false
 
+// TokChars scans bytes with SSE2, and with AVX2 where the cpu has it
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__SSE2__) && (defined(__GNUC__) || defined(__clang__))
+#define DARCS_PATCH_X86_SIMD
+#include <immintrin.h>
+#endif
+
 namespace DarcsPatch {
     // STD IMPL - LLDB by default will not step into std code, this is good EXCEPT if we want to step into std::function
     // stepping into std::function is required in order to step info our assigned function callback
@@ -170,51 +183,57 @@ namespace DarcsPatch {
         }
     };
 
+    // a value computed the first time it is asked for
+    //
+    // copies share one control block holding the closure, a lock and the
+    // value, so forcing any copy forces them all. forcing is safe from
+    // several threads at once, the closure runs exactly once and is
+    // destroyed as soon as the value exists, releasing everything it
+    // captured. if the closure throws the value stays unforced and the
+    // next call runs it again. std::call_once is not used since a throwing
+    // callable leaves it stuck on some platforms and under sanitizers
     template <typename R>
     struct LazyValue {
-        std::shared_ptr<function<R()>> func;
-        mutable std::shared_ptr<R> value;
-        mutable std::shared_ptr<bool> called;
-
-        LazyValue(const function<R()> & f) : func(std::make_shared<function<R()>>(f)), called(std::make_shared<bool>(false)) {}
-
-        LazyValue(const LazyValue<R> & f) {
-            func = f.func;
-            value = f.value;
-            called = f.called;
-        }
-        LazyValue(const LazyValue<R> && f) {
-            func = f.func;
-            value = f.value;
-            called = f.called;
-        }
-        LazyValue<R>&operator=(const LazyValue<R> & f) {
-            func = f.func;
-            value = f.value;
-            called = f.called;
-            return *this;
-        }
-        LazyValue<R>&operator=(const LazyValue<R> && f) {
-            func = f.func;
-            value = f.value;
-            called = f.called;
-            return *this;
-        }
+        struct State {
+            std::mutex mutex;
+            std::atomic<bool> forced { false };
+            std::optional<R> value;
+            virtual void force() = 0;
+            virtual ~State() = default;
+        };
+
+        template <typename F>
+        struct StateWith : State {
+            std::optional<F> func;
+
+            StateWith(const F & f) : func(f) {}
+
+            void force() override {
+                this->value.emplace((*func)());
+                func.reset();
+            }
+        };
+
+        std::shared_ptr<State> state;
+
+        template <typename F, typename = typename std::enable_if<!std::is_same<typename std::decay<F>::type, LazyValue<R>>::value>::type>
+        LazyValue(const F & f) : state(std::make_shared<StateWith<F>>(f)) {}
+
         R & operator ()() const {
-            if (*called.get()) {
-                return *value.get();
-            } else {
-                value = std::make_shared<R>((*func.get())());
-                called = std::make_shared<bool>(true);
-                return *value.get();
+            State * s = state.get();
+            if (!s->forced.load(std::memory_order_acquire)) {
+                std::lock_guard<std::mutex> lock(s->mutex);
+                if (!s->forced.load(std::memory_order_relaxed)) {
+                    s->force();
+                    s->forced.store(true, std::memory_order_release);
+                }
             }
+            return *s->value;
         }
     };
 }
 
 #include <string_adapter.h>
-#include <list>
-#include <forward_list>
 
 #include <sha1.h>
 
@@ -230,34 +249,92 @@ import MemHunk
 
 */
 
+namespace DarcsPatch {
+    // comparison and hashing resolved at compile time
+    //
+    // CLASS provides
+    //     static int compare(const CLASS & a, const CLASS & b);
+    //     static std::size_t hash(const CLASS & a);
+    //
+    // unlike StringAdapter::Comparable and StringAdapter::Hashable nothing is
+    // stored per object, so these bases are empty and every comparison made
+    // by std::set and std::map can be inlined.
+
+    template <typename CLASS>
+    struct StaticComparable {
+        bool operator == (const CLASS & other) const {
+            return CLASS::compare(static_cast<const CLASS &>(*this), other) == 0;
+        }
+
+        bool operator != (const CLASS & other) const {
+            return CLASS::compare(static_cast<const CLASS &>(*this), other) != 0;
+        }
+
+        bool operator < (const CLASS & other) const {
+            return CLASS::compare(static_cast<const CLASS &>(*this), other) < 0;
+        }
+
+        bool operator > (const CLASS & other) const {
+            return CLASS::compare(static_cast<const CLASS &>(*this), other) > 0;
+        }
+
+        bool operator <= (const CLASS & other) const {
+            return CLASS::compare(static_cast<const CLASS &>(*this), other) <= 0;
+        }
+
+        bool operator >= (const CLASS & other) const {
+            return CLASS::compare(static_cast<const CLASS &>(*this), other) >= 0;
+        }
+    };
+
+    template <typename CLASS>
+    struct StaticHashable {
+        std::size_t hashCode() const noexcept {
+            return CLASS::hash(static_cast<const CLASS &>(*this));
+        }
+    };
+}
+
+#define STATIC_COMPARABLE_USING_BASE(...) \
+    using __VA_ARGS__::operator ==; \
+    using __VA_ARGS__::operator !=; \
+    using __VA_ARGS__::operator <; \
+    using __VA_ARGS__::operator >; \
+    using __VA_ARGS__::operator <=; \
+    using __VA_ARGS__::operator >=
+
+#define STATIC_HASHABLE_USING_BASE(...) \
+    using __VA_ARGS__::hashCode
+
 namespace DarcsPatch {
     template <typename T1, typename T2>
     struct Tuple2 :
-        public StringAdapter::Comparable<Tuple2<T1, T2>>,
-        public StringAdapter::Hashable<Tuple2<T1, T2>>
+        public StaticComparable<Tuple2<T1, T2>>,
+        public StaticHashable<Tuple2<T1, T2>>
     {
         using THIS = Tuple2<T1, T2>;
-        COMPARABLE_USING_BASE(StringAdapter::Comparable<THIS>);
-        HASHABLE_USING_BASE(StringAdapter::Hashable<THIS>);
+        STATIC_COMPARABLE_USING_BASE(StaticComparable<THIS>);
+        STATIC_HASHABLE_USING_BASE(StaticHashable<THIS>);
 
-        Tuple2() :
-            THIS::Comparable([](auto & a, auto & b) { return StringAdapter::compare_3(a, b, &THIS::v1, &THIS::v2); }),
-            THIS::Hashable([](auto & a) { return StringAdapter::hash_3(a, &THIS::v1, &THIS::v2); })
-        {}
+        static int compare(const THIS & a, const THIS & b) {
+            return StringAdapter::compare_3(a, b, &THIS::v1, &THIS::v2);
+        }
+
+        static std::size_t hash(const THIS & a) {
+            return StringAdapter::hash_3(a, &THIS::v1, &THIS::v2);
+        }
+
+        Tuple2() {}
 
         T1 v1;
         T2 v2;
 
         Tuple2(const std::pair<T1, T2> & pair) :
-            THIS::Comparable([](auto & a, auto & b) { return StringAdapter::compare_3(a, b, &THIS::v1, &THIS::v2); }),
-            THIS::Hashable([](auto & a) { return StringAdapter::hash_3(a, &THIS::v1, &THIS::v2); }),
             v1(pair.first),
             v2(pair.second)
         {}
 
         Tuple2(const T1 & t1, const T2 & t2) :
-            THIS::Comparable([](auto & a, auto & b) { return StringAdapter::compare_3(a, b, &THIS::v1, &THIS::v2); }),
-            THIS::Hashable([](auto & a) { return StringAdapter::hash_3(a, &THIS::v1, &THIS::v2); }),
             v1(t1),
             v2(t2)
         {
@@ -300,25 +377,28 @@ namespace DarcsPatch {
 namespace DarcsPatch {
     template <typename T1, typename T2, typename T3>
     struct Tuple3 :
-        public StringAdapter::Comparable<Tuple3<T1, T2, T3>>,
-        public StringAdapter::Hashable<Tuple3<T1, T2, T3>>
+        public StaticComparable<Tuple3<T1, T2, T3>>,
+        public StaticHashable<Tuple3<T1, T2, T3>>
     {
         using THIS = Tuple3<T1, T2, T3>;
-        COMPARABLE_USING_BASE(StringAdapter::Comparable<THIS>);
-        HASHABLE_USING_BASE(StringAdapter::Hashable<THIS>);
+        STATIC_COMPARABLE_USING_BASE(StaticComparable<THIS>);
+        STATIC_HASHABLE_USING_BASE(StaticHashable<THIS>);
 
-        Tuple3() :
-            THIS::Comparable([](auto & a, auto & b) { return StringAdapter::compare_3(a, b, &THIS::v1, &THIS::v2, &THIS::v3); }),
-            THIS::Hashable([](auto & a) { return StringAdapter::hash_3(a, &THIS::v1, &THIS::v2, &THIS::v3); })
-        {}
+        static int compare(const THIS & a, const THIS & b) {
+            return StringAdapter::compare_3(a, b, &THIS::v1, &THIS::v2, &THIS::v3);
+        }
+
+        static std::size_t hash(const THIS & a) {
+            return StringAdapter::hash_3(a, &THIS::v1, &THIS::v2, &THIS::v3);
+        }
+
+        Tuple3() {}
 
         T1 v1;
         T2 v2;
         T3 v3;
 
         Tuple3(const T1 & t1, const T2 & t2, const T3 & t3) :
-            THIS::Comparable([](auto & a, auto & b) { return StringAdapter::compare_3(a, b, &THIS::v1, &THIS::v2, &THIS::v3); }),
-            THIS::Hashable([](auto & a) { return StringAdapter::hash_3(a, &THIS::v1, &THIS::v2, &THIS::v3); }),
             v1(t1),
             v2(t2),
             v3(t3)
@@ -399,482 +479,495 @@ namespace DarcsPatch {
     extern const NilFL_T NilFL;
     extern const NilRL_T NilRL;
 
-    template <typename T, typename O>
-    class Slice :
-        public StringAdapter::Comparable<Slice<T, O>>,
-        public StringAdapter::Hashable<Slice<T, O>>
-    {
-        using THIS = Slice<T, O>;
-        COMPARABLE_USING_BASE(StringAdapter::Comparable<THIS>);
-        HASHABLE_USING_BASE(StringAdapter::Hashable<THIS>);
+    // persistent backing store for FL_BASE and RL_BASE
+    //
+    // items are kept in push order in contiguous chunks. the chunks of a
+    // store are the leaves of an immutable, balanced tree plus one tail
+    // chunk that is still being pushed into, so copying a store is O(1),
+    // indexing is O(log n) and every copy shares its chunks with the store
+    // it was copied from.
+    //
+    // a chunk is never modified once an item has been stored in it. the
+    // store whose tail ends exactly where its chunk is filled up to may
+    // append in place, any other store pushing onto the same chunk (an
+    // older version, or one that has popped items) starts a new chunk
+    // instead of copying the items it already has.
+    //
+    // most lists hold one or two items, so the first INLINE_ITEMS items are
+    // stored in the store itself and it only spills into chunks once it
+    // grows past them. copying a small store copies its items.
+    //
+    template <typename T, std::size_t CHUNK_BITS = 5, std::size_t INLINE_ITEMS = 2>
+    class ChunkedStore {
+        static constexpr std::size_t CHUNK_SIZE = std::size_t(1) << CHUNK_BITS;
 
-        O * origin = nullptr;
-        std::size_t start_ = 0;
-        std::size_t end_ = 0;
+        class Chunk {
+            std::allocator<T> allocator;
+            T * items_;
+            const std::size_t capacity_;
+            std::atomic<std::size_t> filled { 0 };
 
-        public:
+            public:
 
-        Slice() :
-            THIS::Comparable([](auto & a, auto & b) { return StringAdapter::compare_3_iterator(a, b, &THIS::cbegin, &THIS::cend); }),
-            THIS::Hashable([](auto & a) { return StringAdapter::hash_3_iterator<THIS, T>(a); })
-        {}
+            Chunk(const std::size_t capacity) : items_(allocator.allocate(capacity)), capacity_(capacity) {}
 
-        Slice(O* origin, std::size_t start, std::size_t end) :
-            THIS::Comparable([](auto & a, auto & b) { return StringAdapter::compare_3_iterator(a, b, &THIS::cbegin, &THIS::cend); }),
-            THIS::Hashable([](auto & a) { return StringAdapter::hash_3_iterator<THIS, T>(a); }),
-            origin(origin),
-            start_(start),
-            end_(start < end ? end : start)
-        {
-        }
+            Chunk(const Chunk &) = delete;
+            Chunk & operator =(const Chunk &) = delete;
 
-        ~Slice() {
-        }
+            ~Chunk() {
+                const std::size_t n = filled.load();
+                for (std::size_t i = 0; i < n; i++) {
+                    items_[i].~T();
+                }
+                allocator.deallocate(items_, capacity_);
+            }
 
-        using iterator = IndexedIterator::iterator<O, T>;
+            T * items() const {
+                return items_;
+            }
 
-        iterator begin() {
-            return iterator(origin, start_);
-        }
+            // how many more items can be appended in place at index `at`
+            const std::size_t available(const std::size_t at) const {
+                return filled.load() == at ? capacity_ - at : 0;
+            }
 
-        iterator end() {
-            return iterator(origin, start_ == end_ ? start_ : end_);
-        }
+            // stores item at index `at` if nothing has been stored there yet
+            bool try_append(const std::size_t at, const T & item) {
+                if (at >= capacity_) {
+                    return false;
+                }
+                std::size_t expected = at;
+                if (!filled.compare_exchange_strong(expected, at + 1)) {
+                    return false;
+                }
+                try {
+                    new (items_ + at) T(item);
+                } catch (...) {
+                    // nothing can have been stored after `at` as no store
+                    // ends past it yet
+                    filled.store(at);
+                    throw;
+                }
+                return true;
+            }
+        };
 
-        using const_iterator = IndexedIterator::iterator<const O, const T>;
+        struct Node;
+        using NodePtr = std::shared_ptr<const Node>;
 
-        const const_iterator cbegin() const {
-            return const_iterator(origin, start_);
-        }
+        // a leaf refers to `size` items of a chunk, a branch has two children
+        struct Node {
+            NodePtr left;
+            NodePtr right;
+            std::shared_ptr<Chunk> chunk;
+            std::size_t offset = 0;
+            std::size_t size = 0;
+            int height = 0;
+        };
 
-        const const_iterator cend() const {
-            return const_iterator(origin, start_ == end_ ? start_ : end_);
+        static int height(const NodePtr & node) {
+            return node ? node->height : -1;
         }
 
-        const const_iterator begin() const {
-            return cbegin();
+        static NodePtr make_leaf(const std::shared_ptr<Chunk> & chunk, const std::size_t offset, const std::size_t size) {
+            auto node = std::make_shared<Node>();
+            node->chunk = chunk;
+            node->offset = offset;
+            node->size = size;
+            return node;
         }
 
-        const const_iterator end() const {
-            return cend();
+        static NodePtr make_branch(const NodePtr & left, const NodePtr & right) {
+            auto node = std::make_shared<Node>();
+            node->left = left;
+            node->right = right;
+            node->size = left->size + right->size;
+            node->height = 1 + std::max(left->height, right->height);
+            return node;
         }
 
-        T & operator[] (const std::size_t index) {
-            return origin->operator[](start_ + index);
+        // joins two trees whose heights differ by at most two
+        static NodePtr balance(const NodePtr & left, const NodePtr & right) {
+            if (height(left) > height(right) + 1) {
+                if (height(left->left) >= height(left->right)) {
+                    return make_branch(left->left, make_branch(left->right, right));
+                }
+                return make_branch(make_branch(left->left, left->right->left), make_branch(left->right->right, right));
+            }
+            if (height(right) > height(left) + 1) {
+                if (height(right->right) >= height(right->left)) {
+                    return make_branch(make_branch(left, right->left), right->right);
+                }
+                return make_branch(make_branch(left, right->left->left), make_branch(right->left->right, right->right));
+            }
+            return make_branch(left, right);
         }
 
-        const std::size_t get_start() {
-            return start_;
-        };
-
-        const std::size_t get_end() {
-            return end_;
-        };
-
-        const std::size_t size() const {
-            return end_ - start_;
+        // O(|height(left) - height(right)|)
+        static NodePtr join(const NodePtr & left, const NodePtr & right) {
+            if (!left) return right;
+            if (!right) return left;
+            if (height(left) > height(right) + 1) {
+                return balance(left->left, join(left->right, right));
+            }
+            if (height(right) > height(left) + 1) {
+                return balance(join(left, right->left), right->right);
+            }
+            return make_branch(left, right);
         }
 
-        O* get_origin() {
-            return origin;
+        // removes the right most leaf of node and stores it in `last`
+        static NodePtr pop_last(const NodePtr & node, NodePtr & last) {
+            if (!node->left) {
+                last = node;
+                return nullptr;
+            }
+            return join(node->left, pop_last(node->right, last));
         }
 
-        protected:
-        O* get_origin_() {
-            return origin;
+        struct Large {
+            NodePtr root;
+            std::shared_ptr<Chunk> tail;
+            std::size_t tail_offset = 0;
         };
-    };
-    
-    template <typename T, typename O>
-    class CSlice :
-        public StringAdapter::Comparable<CSlice<T, O>>,
-        public StringAdapter::Hashable<CSlice<T, O>>
-    {
-        using THIS = CSlice<T, O>;
-        COMPARABLE_USING_BASE(StringAdapter::Comparable<THIS>);
-        HASHABLE_USING_BASE(StringAdapter::Hashable<THIS>);
-
-        const O * origin = nullptr;
-        std::size_t start_ = 0;
-        std::size_t end_ = 0;
-
-        public:
 
-        CSlice() :
-            THIS::Comparable([](auto & a, auto & b) { return StringAdapter::compare_3_iterator(a, b, &THIS::cbegin, &THIS::cend); }),
-            THIS::Hashable([](auto & a) { return StringAdapter::hash_3_iterator<THIS, T>(a); })
-        {}
-
-        CSlice(const O* origin, const std::size_t start, const std::size_t end) :
-            THIS::Comparable([](auto & a, auto & b) { return StringAdapter::compare_3_iterator(a, b, &THIS::cbegin, &THIS::cend); }),
-            THIS::Hashable([](auto & a) { return StringAdapter::hash_3_iterator<THIS, T>(a); }),
-            origin(origin),
-            start_(start),
-            end_(start < end ? end : start)
-        {
-        }
+        // at least one item is always kept inline, more only if they fit in
+        // the space the tree would use anyway
+        static constexpr std::size_t INLINE_SIZE =
+            INLINE_ITEMS == 0 ? 0 : std::max(std::size_t(1), std::min(INLINE_ITEMS, sizeof(Large) / sizeof(T)));
 
-        ~CSlice() {
-        }
-
-        using iterator = IndexedIterator::iterator<O, T>;
+        // until the store spills, its items live in buffer and `count` is
+        // how many there are, after that `count` is the size of the tail
+        union {
+            Large large;
+            alignas(T) unsigned char buffer[std::max(sizeof(Large), INLINE_SIZE * sizeof(T))];
+        };
+        std::size_t count = 0;
+        bool spilled = false;
 
-        iterator begin() {
-            return iterator(origin, start_);
+        T * inline_items() const {
+            return reinterpret_cast<T *>(const_cast<unsigned char *>(buffer));
         }
 
-        iterator end() {
-            return iterator(origin, start_ == end_ ? start_ : end_);
+        std::size_t root_size() const {
+            return large.root ? large.root->size : 0;
         }
 
-        using const_iterator = IndexedIterator::iterator<const O, const T>;
-
-        const const_iterator cbegin() const {
-            return const_iterator(origin, start_);
+        void flush_tail() {
+            if (count != 0) {
+                large.root = join(large.root, make_leaf(large.tail, large.tail_offset, count));
+            }
+            large.tail.reset();
+            large.tail_offset = 0;
+            count = 0;
         }
 
-        const const_iterator cend() const {
-            return const_iterator(origin, start_ == end_ ? start_ : end_);
+        void destroy() {
+            if (spilled) {
+                large.~Large();
+            } else {
+                for (std::size_t i = 0; i < count; i++) {
+                    inline_items()[i].~T();
+                }
+            }
+            count = 0;
+            spilled = false;
         }
 
-        const const_iterator begin() const {
-            return cbegin();
+        // moves the inline items into a new tail chunk with room for
+        // `capacity` items
+        void spill(const std::size_t capacity) {
+            auto chunk = std::make_shared<Chunk>(std::max(capacity, count));
+            for (std::size_t i = 0; i < count; i++) {
+                chunk->try_append(i, inline_items()[i]);
+            }
+            const std::size_t n = count;
+            destroy();
+            new (&large) Large();
+            large.tail = std::move(chunk);
+            count = n;
+            spilled = true;
+        }
+
+        // both of these expect this store to be destroyed or unconstructed
+        void copy_from(const ChunkedStore & other) {
+            if (other.spilled) {
+                new (&large) Large(other.large);
+                spilled = true;
+                count = other.count;
+                return;
+            }
+            try {
+                for (; count < other.count; count++) {
+                    new (inline_items() + count) T(other.inline_items()[count]);
+                }
+            } catch (...) {
+                destroy();
+                throw;
+            }
         }
 
-        const const_iterator end() const {
-            return cend();
+        void move_from(ChunkedStore & other) {
+            if (!other.spilled) {
+                for (; count < other.count; count++) {
+                    new (inline_items() + count) T(std::move(other.inline_items()[count]));
+                }
+                other.destroy();
+                return;
+            }
+            new (&large) Large(std::move(other.large));
+            spilled = true;
+            count = other.count;
+            other.destroy();
         }
 
-        const std::size_t get_start() {
-            return start_;
-        };
-
-        const std::size_t get_end() {
-            return end_;
-        };
+        public:
 
-        const T & operator[] (const std::size_t index) const {
-            return origin->operator[](start_ + index);
-        }
+        ChunkedStore() {}
 
-        const std::size_t size() const {
-            return end_ - start_;
+        ChunkedStore(const ChunkedStore & other) {
+            copy_from(other);
         }
 
-        const O* get_origin() {
-            return origin;
+        ChunkedStore(ChunkedStore && other) {
+            move_from(other);
         }
 
-        protected:
-        const O* get_origin_() {
-            return origin;
-        };
-    };
-
-    template <typename T>
-    struct FL_BASE {
-        
-        typedef T TYPE;
-        mutable std::forward_list<T> list = {};
-        mutable std::size_t len = 0;
-        
-        FL_BASE() = default;
-
-        FL_BASE(const FL_BASE & other) {
-            list = other.list;
-            len = other.len;
-        }
-        
-        const FL_BASE & operator =(const FL_BASE & other) {
-            list = other.list;
-            len = other.len;
-            return *this;
-        }
-        
-        FL_BASE(FL_BASE && other) {
-            list = std::move(other.list);
-            len = std::move(other.len);
-        }
-        
-        const FL_BASE & operator =(FL_BASE && other) {
-            list = std::move(other.list);
-            len = std::move(other.len);
+        ChunkedStore & operator =(const ChunkedStore & other) {
+            if (this != &other) {
+                ChunkedStore copy(other);
+                destroy();
+                move_from(copy);
+            }
             return *this;
         }
 
-        using iterator = IndexedIterator::iterator<FL_BASE<T>, T>;
-        using const_iterator = IndexedIterator::iterator<const FL_BASE<T>, const T>;
-
-        iterator begin() {
-            return iterator(this, 0);
-        }
-
-        iterator end() {
-            return iterator(this, length()+1);
-        }
-
-        const const_iterator cbegin() const {
-            return const_iterator(this, 0);
-        }
-
-        const const_iterator cend() const {
-            return const_iterator(this, length()+1);
+        ChunkedStore & operator =(ChunkedStore && other) {
+            if (this != &other) {
+                destroy();
+                move_from(other);
+            }
+            return *this;
         }
 
-        const const_iterator begin() const {
-            return cbegin();
+        ~ChunkedStore() {
+            destroy();
         }
 
-        const const_iterator end() const {
-            return cend();
+        T & operator[] (std::size_t index) const {
+            if (!spilled) {
+                return inline_items()[index];
+            }
+            const std::size_t rs = root_size();
+            if (index >= rs) {
+                return large.tail->items()[large.tail_offset + index - rs];
+            }
+            const Node * node = large.root.get();
+            while (node->left) {
+                if (index < node->left->size) {
+                    node = node->left.get();
+                } else {
+                    index -= node->left->size;
+                    node = node->right.get();
+                }
+            }
+            return node->chunk->items()[node->offset + index];
         }
 
-        void THROW(const char * what) const {
-            throw std::runtime_error(what);
+        T & back() const {
+            return operator[](size() - 1);
         }
 
-        Slice<T, FL_BASE<T>>* slice(std::size_t start, std::size_t end) {
-            if (start == 0 && end == 0 && len == 0) {
-            } else {
-                if (start >= len) {
-                    return slice(0, 0);
-                }
-                if (end > len) {
-                    THROW("ATTEMPTING TO SLICE OUT OF RANGE");
+        void emplace_back(const T & item) {
+            if (!spilled) {
+                if (count < INLINE_SIZE) {
+                    new (inline_items() + count) T(item);
+                    count++;
+                    return;
                 }
+                spill(std::min(CHUNK_SIZE, std::max(std::size_t(1), count * 2)));
             }
-            return new Slice<T, FL_BASE<T>>(this, start, end);
-        }
-        const CSlice<T, FL_BASE<T>>* cslice(std::size_t start, std::size_t end) {
-            if (start == 0 && end == 0 && len == 0) {
-            } else {
-                if (start >= len) {
-                    return slice(0, 0);
-                }
-                if (end > len) {
-                    THROW("ATTEMPTING TO SLICE OUT OF RANGE");
+            if (large.tail && large.tail->try_append(large.tail_offset + count, item)) {
+                count++;
+                return;
+            }
+            flush_tail();
+            // small stores get small chunks, growing up to CHUNK_SIZE
+            large.tail = std::make_shared<Chunk>(std::min(CHUNK_SIZE, std::max(std::size_t(1), size())));
+            large.tail->try_append(0, item);
+            count = 1;
+        }
+
+        // appends the items of other after the items of this store, this is
+        // O(log n) and both stores keep sharing their chunks
+        void append(const ChunkedStore & other) {
+            if (!other.spilled) {
+                const std::size_t n = other.count;
+                for (std::size_t i = 0; i < n; i++) {
+                    emplace_back(other.inline_items()[i]);
                 }
+                return;
             }
-            return new CSlice<T, FL_BASE<T>>(this, start, end);
-        }
-        const CSlice<T, FL_BASE<T>>* slice(std::size_t start, std::size_t end) const {
-            if (start == 0 && end == 0 && len == 0) {
-            } else {
-                if (start >= len) {
-                    return slice(0, 0);
+            if (other.size() == 0) {
+                return;
+            }
+            if (!spilled) {
+                if (count == 0) {
+                    *this = other;
+                    return;
                 }
-                if (end > len) {
-                    THROW("ATTEMPTING TO SLICE OUT OF RANGE");
+                spill(count);
+            }
+            flush_tail();
+            large.root = join(large.root, other.large.root);
+            large.tail = other.large.tail;
+            large.tail_offset = other.large.tail_offset;
+            count = other.count;
+        }
+
+        // makes room for `n` more items to be appended without allocating
+        // another chunk
+        void reserve(const std::size_t n) {
+            if (!spilled) {
+                if (count + n > INLINE_SIZE) {
+                    spill(count + n);
                 }
+                return;
             }
-            return new CSlice<T, FL_BASE<T>>(this, start, end);
+            if (n == 0 || (large.tail && large.tail->available(large.tail_offset + count) >= n)) {
+                return;
+            }
+            flush_tail();
+            large.tail = std::make_shared<Chunk>(n);
         }
-        
-        T & get_item_at_index(const std::size_t index) {
-            if (index >= len) {
-                THROW("INDEX OUT OF RANGE");
+
+        void pop_back() {
+            if (!spilled) {
+                count--;
+                inline_items()[count].~T();
+                return;
+            }
+            if (count == 0) {
+                NodePtr last;
+                large.root = pop_last(large.root, last);
+                large.tail = last->chunk;
+                large.tail_offset = last->offset;
+                count = last->size;
             }
-            return *std::next(list.begin(), index);
+            count--;
+            if (count == 0) {
+                large.tail.reset();
+                large.tail_offset = 0;
+            }
+        }
+
+        const std::size_t size() const {
+            return spilled ? root_size() + count : count;
+        }
+    };
+
+    template <typename T>
+    struct FL_BASE {
+        typedef T TYPE;
+        // index 0 is the most recently emplaced item, it is stored last
+        ChunkedStore<T> list;
+
+        void THROW(const char * what) const {
+            throw std::runtime_error(what);
         }
-        const T & get_item_at_index(const std::size_t index) const {
+
+        T & get_item_at_index(const std::size_t index) const {
+            const std::size_t len = list.size();
             if (index >= len) {
                 THROW("INDEX OUT OF RANGE");
             }
-            return *std::next(list.begin(), index);
+            return list[len - 1 - index];
         }
-        
-        T & operator[] (const std::size_t index) {
-            return get_item_at_index(index);
-        };
 
-        const T & operator[] (const std::size_t index) const {
+        T & operator[] (const std::size_t index) const {
             return get_item_at_index(index);
         };
-        
+
         const std::size_t length() const {
-            return len;
+            return list.size();
         }
-        
+
         const std::size_t size() const {
             return length();
         }
-        
-        const bool operator == (const FL_BASE<T> & other) const {
-            const std::size_t max = length();
-            if (max != other.length()) {
-                return false;
-            }
-            for (std::size_t i = 0; i < max; i++) {
-                if (operator[](i) != other.operator[](i)) {
-                    return false;
-                }
-            }
-            return true;
+
+        // pushes every item of other as one block, other ends up in front of
+        // the items of this base in the same order it had in other
+        void concat(const FL_BASE & other) {
+            list.append(other.list);
         }
 
-        const bool operator != (const FL_BASE<T> & other) const {
-            return !(*this == other);
+        void reserve(const std::size_t count) {
+            list.reserve(count);
         }
 
         void emplace(const T & item) {
-            list.emplace_front(item);
-            len++;
+            list.emplace_back(item);
         }
 
-        ~FL_BASE() {
+        // removes the item at index 0
+        void pop(T & out) {
+            if (list.size() == 0) {
+                THROW("INDEX OUT OF RANGE");
+            }
+            out = list.back();
+            list.pop_back();
         }
     };
 
     template <typename T>
     struct RL_BASE {
         typedef T TYPE;
-        mutable std::list<T> list = {};
-        mutable std::size_t len = 0;
-        
-        RL_BASE() = default;
+        ChunkedStore<T> list;
 
-        RL_BASE(const RL_BASE & other) {
-            list = other.list;
-            len = other.len;
-        }
-        
-        const RL_BASE & operator =(const RL_BASE & other) {
-            list = other.list;
-            len = other.len;
-            return *this;
-        }
-        
-        RL_BASE(RL_BASE && other) {
-            list = std::move(other.list);
-            len = std::move(other.len);
+        void THROW(const char * what) const {
+            throw std::runtime_error(what);
         }
-        
-        const RL_BASE & operator =(RL_BASE && other) {
-            list = std::move(other.list);
-            len = std::move(other.len);
-            return *this;
+
+        T & get_item_at_index(const std::size_t index) const {
+            if (index >= list.size()) {
+                THROW("INDEX OUT OF RANGE");
+            }
+            return list[index];
         }
 
-        using iterator = IndexedIterator::iterator<RL_BASE<T>, T>;
-        using const_iterator = IndexedIterator::iterator<const RL_BASE<T>, const T>;
+        T & operator[] (const std::size_t index) const {
+            return get_item_at_index(index);
+        };
 
-        iterator begin() {
-            return iterator(this, 0);
+        const std::size_t length() const {
+            return list.size();
         }
 
-        iterator end() {
-            return iterator(this, length()+1);
+        const std::size_t size() const {
+            return length();
         }
 
-        const const_iterator cbegin() const {
-            return const_iterator(this, 0);
+        // pushes every item of other as one block, after the items of this base
+        void concat(const RL_BASE & other) {
+            list.append(other.list);
         }
 
-        const const_iterator cend() const {
-            return const_iterator(this, length()+1);
+        void reserve(const std::size_t count) {
+            list.reserve(count);
         }
 
-        const const_iterator begin() const {
-            return cbegin();
+        void emplace(const T & item) {
+            list.emplace_back(item);
         }
 
-        const const_iterator end() const {
-            return cend();
-        }
-
-        void THROW(const char * what) const {
-            throw std::runtime_error(what);
-        }
-
-        Slice<T, RL_BASE<T>>* slice(std::size_t start, std::size_t end) {
-            if (start == 0 && end == 0 && len == 0) {
-            } else {
-                if (start >= len) {
-                    return slice(0, 0);
-                }
-                if (end > len) {
-                    THROW("ATTEMPTING TO SLICE OUT OF RANGE");
-                }
-            }
-            return new Slice<T, RL_BASE<T>>(this, start, end);
-        }
-        const CSlice<T, RL_BASE<T>>* cslice(std::size_t start, std::size_t end) {
-            if (start == 0 && end == 0 && len == 0) {
-            } else {
-                if (start >= len) {
-                    return slice(0, 0);
-                }
-                if (end > len) {
-                    THROW("ATTEMPTING TO SLICE OUT OF RANGE");
-                }
-            }
-            return new CSlice<T, RL_BASE<T>>(this, start, end);
-        }
-        const CSlice<T, RL_BASE<T>>* slice(std::size_t start, std::size_t end) const {
-            if (start == 0 && end == 0 && len == 0) {
-            } else {
-                if (start >= len) {
-                    return slice(0, 0);
-                }
-                if (end > len) {
-                    THROW("ATTEMPTING TO SLICE OUT OF RANGE");
-                }
-            }
-            return new CSlice<T, RL_BASE<T>>(this, start, end);
-        }
-
-        T & get_item_at_index(const std::size_t index) {
-            if (index >= len) {
+        // removes the last item
+        void pop(T & out) {
+            if (list.size() == 0) {
                 THROW("INDEX OUT OF RANGE");
             }
-            return *std::next(list.begin(), index);
-        }
-        const T & get_item_at_index(const std::size_t index) const {
-            if (index >= len) {
-                THROW("INDEX OUT OF RANGE");
-            }
-            return *std::next(list.begin(), index);
-        }
-        
-        T & operator[] (const std::size_t index) {
-            return get_item_at_index(index);
-        };
-
-        const T & operator[] (const std::size_t index) const {
-            return get_item_at_index(index);
-        };
-        
-        const std::size_t length() const {
-            return len;
-        }
-        
-        const std::size_t size() const {
-            return length();
-        }
-        
-        const bool operator == (const RL_BASE<T> & other) const {
-            const std::size_t max = length();
-            if (max != other.length()) {
-                return false;
-            }
-            for (std::size_t i = 0; i < max; i++) {
-                if (operator[](i) != other.operator[](i)) {
-                    return false;
-                }
-            }
-            return true;
-        }
-
-        const bool operator != (const RL_BASE<T> & other) const {
-            return !(*this == other);
-        }
-
-        void emplace(const T & item) {
-            list.emplace_back(item);
-            len++;
-        }
-
-        ~RL_BASE() {
+            out = list.back();
+            list.pop_back();
         }
     };
 
@@ -883,7 +976,6 @@ namespace DarcsPatch {
         HASHABLE_USING_BASE(INDEXED_ITERATOR_EMBED_COMMAS(BASE)); \
         using BASE::BASE_CONSTRUCTOR; \
         using BASE::base; \
-        using BASE::slice; \
         using BASE::to_string; \
         using BASE::operator []; \
         using BASE::begin; \
@@ -898,86 +990,57 @@ namespace DarcsPatch {
 
     template <typename CLASS, typename CLASS_BASE, typename NILL_CLASS, typename T>
     struct FL_RL_COMMON :
-        public StringAdapter::Comparable<CLASS>,
-        public StringAdapter::Hashable<CLASS>
+        public StaticComparable<CLASS>,
+        public StaticHashable<CLASS>
     {
-        std::shared_ptr<CLASS_BASE> base;
-        Slice<T, CLASS_BASE> * slice = nullptr;
+        // the base is a persistent store, copying it is O(1) and shares its
+        // items with the list it was copied from
+        CLASS_BASE base;
 
-        COMPARABLE_USING_BASE(StringAdapter::Comparable<CLASS>);
-        HASHABLE_USING_BASE(StringAdapter::Hashable<CLASS>);
+        STATIC_COMPARABLE_USING_BASE(StaticComparable<CLASS>);
+        STATIC_HASHABLE_USING_BASE(StaticHashable<CLASS>);
 
-        FL_RL_COMMON() :
-            CLASS::Comparable([](auto & a, auto & b) { return StringAdapter::compare_3_iterator(a, b, &CLASS::cbegin, &CLASS::cend); }),
-            CLASS::Hashable([](auto & a) { return StringAdapter::hash_3_iterator<CLASS, T>(a); })
-        {
-            base = std::make_shared<CLASS_BASE>();
-            slice = base->slice(0, 0);
+        static int compare(const CLASS & a, const CLASS & b) {
+            return StringAdapter::compare_3_iterator(a, b, &CLASS::cbegin, &CLASS::cend);
         }
 
-        FL_RL_COMMON(const std::initializer_list<T> & list) :
-            CLASS::Comparable([](auto & a, auto & b) { return StringAdapter::compare_3_iterator(a, b, &CLASS::cbegin, &CLASS::cend); }),
-            CLASS::Hashable([](auto & a) { return StringAdapter::hash_3_iterator<CLASS, T>(a); })
-        {
-            base = std::make_shared<CLASS_BASE>();
-            std::size_t size = 0;
+        static std::size_t hash(const CLASS & a) {
+            return StringAdapter::hash_3_iterator<CLASS, T>(a);
+        }
+
+        FL_RL_COMMON() {
+        }
+
+        FL_RL_COMMON(const std::initializer_list<T> & list) {
             for(const T & item : list) {
-                base->emplace(item);
-                size++;
+                base.emplace(item);
             }
-            slice = base->slice(0, size);
         }
 
         FL_RL_COMMON(const NILL_CLASS & nil) : FL_RL_COMMON() {}
 
         ~FL_RL_COMMON() {
-            delete slice;
-            slice = nullptr;
         }
 
         const bool operator == (const NILL_CLASS & other) const {
-            return slice->get_start() == 0 && slice->get_end() == 0;
+            return base.length() == 0;
         }
 
         const bool operator != (const NILL_CLASS & other) const {
             return !(*this == other);
         }
 
-        FL_RL_COMMON(const FL_RL_COMMON & other) : StringAdapter::Comparable<CLASS>(other), StringAdapter::Hashable<CLASS>(other) {
-            base = other.base;
-            if (slice == nullptr) {
-                slice = base->slice(0, 0);
-            }
-            *slice = *other.slice;
-        }
+        FL_RL_COMMON(const FL_RL_COMMON & other) : base(other.base) {}
 
-        FL_RL_COMMON(FL_RL_COMMON && other) : StringAdapter::Comparable<CLASS>(std::move(other)), StringAdapter::Hashable<CLASS>(std::move(other)) {
-            base = std::move(other.base);
-            if (slice == nullptr) {
-                slice = base->slice(0, 0);
-            }
-            *slice = *other.slice;
-        }
+        FL_RL_COMMON(FL_RL_COMMON && other) : base(std::move(other.base)) {}
 
         FL_RL_COMMON & operator =(const FL_RL_COMMON & other) {
-            StringAdapter::Comparable<CLASS>::operator =(other);
-            StringAdapter::Hashable<CLASS>::operator =(other);
             base = other.base;
-            if (slice == nullptr) {
-                slice = base->slice(0, 0);
-            }
-            *slice = *other.slice;
             return *this;
         }
 
         FL_RL_COMMON & operator =(FL_RL_COMMON && other) {
-            StringAdapter::Comparable<CLASS>::operator =(std::move(other));
-            StringAdapter::Hashable<CLASS>::operator =(std::move(other));
             base = std::move(other.base);
-            if (slice == nullptr) {
-                slice = base->slice(0, 0);
-            }
-            *slice = *other.slice;
             return *this;
         }
 
@@ -990,30 +1053,30 @@ namespace DarcsPatch {
         }
 
         T & operator[] (const std::size_t index) {
-            return slice->operator[](index);
+            return base[index];
         }
 
         const T & operator[] (const std::size_t index) const {
-            return slice->operator[](index);
+            return base[index];
         }
 
-        using iterator = typename Slice<T, CLASS_BASE>::iterator;
-        using const_iterator = typename Slice<T, CLASS_BASE>::const_iterator;
+        using iterator = IndexedIterator::iterator<CLASS_BASE, T>;
+        using const_iterator = IndexedIterator::iterator<const CLASS_BASE, const T>;
 
         iterator begin() {
-            return slice->begin();
+            return iterator(&base, 0);
         }
 
         iterator end() {
-            return slice->end();
+            return iterator(&base, base.length());
         }
 
         const const_iterator cbegin() const {
-            return slice->cbegin();
+            return const_iterator(&base, 0);
         }
 
         const const_iterator cend() const {
-            return slice->cend();
+            return const_iterator(&base, base.length());
         }
 
         const const_iterator begin() const {
@@ -1024,73 +1087,61 @@ namespace DarcsPatch {
             return cend();
         }
 
-        // using reverse_iterator = typename Slice<T, FL_BASE<T>>::reverse_iterator;
-        // using const_reverse_iterator = typename Slice<T, FL_BASE<T>>::const_reverse_iterator;
-
-        // reverse_iterator rbegin() {
-        //     return slice->rbegin();
-        // }
+        const std::size_t size() const {
+            return base.length();
+        }
 
-        // reverse_iterator rend() {
-        //     return slice->rend();
-        // }
+        // builds a list in place, push behaves exactly as the list's own
+        // push but does not create a new list for every item
+        //
+        //   typename FL<T>::Builder builder;
+        //   builder.reserve(items.size());
+        //   for (const T & item : items) builder.push(item);
+        //   FL<T> fl = builder.freeze();
+        //
+        class Builder {
+            CLASS_BASE base;
 
-        // const const_reverse_iterator crbegin() const {
-        //     return slice->crbegin();
-        // }
+            public:
 
-        // const const_reverse_iterator crend() const {
-        //     return slice->crend();
-        // }
+            Builder & reserve(const std::size_t count) {
+                base.reserve(count);
+                return *this;
+            }
 
-        // const const_reverse_iterator rbegin() const {
-        //     return crbegin();
-        // }
+            Builder & push(const T & item) {
+                base.emplace(item);
+                return *this;
+            }
 
-        // const const_reverse_iterator rend() const {
-        //     return crend();
-        // }
+            const std::size_t size() const {
+                return base.length();
+            }
 
-        const std::size_t size() const {
-            return slice->size();
-        }
+            // hands the items over to a list, the builder is left empty
+            CLASS freeze() {
+                CLASS list;
+                list.base = std::move(base);
+                return list;
+            }
+        };
 
+        // O(1) amortised on any version of a list, the result shares every
+        // item with this list
         CLASS push(const T & item) const {
-            CLASS copy;
-            if (slice->get_end() != base->length()) {
-                auto b = begin();
-                auto e = end();
-                for (; b != e; ++b) {
-                    copy.base->emplace(*b);
-                }
-            } else {
-                copy.base = base;
-            }
-            copy.base->emplace(item);
-            auto s = copy.base->slice(0, slice->get_end()+1);
-            *copy.slice = *s;
-            delete s;
+            CLASS copy = *static_cast<const CLASS*>(this);
+            copy.base.emplace(item);
             return copy;
         }
 
+        // pushes fl as one block where push(item) would put an item, for an FL
+        // this gives fl +>+ this and for an RL this +<+ fl
+        //
+        // O(log n), the result shares its items with both lists
         CLASS push(const CLASS & fl) const {
             if (fl.size() == 0) return *static_cast<const CLASS*>(this);
-            CLASS copy;
-            if (slice->get_end() != base->length()) {
-                auto b = begin();
-                auto e = end();
-                for (; b != e; ++b) {
-                    copy.base->emplace(*b);
-                }
-            } else {
-                copy.base = base;
-            }
-            for(const T & item : fl) {
-                copy.base->emplace(item);
-            }
-            auto s = copy.base->slice(0, slice->get_end()+fl.size());
-            *copy.slice = *s;
-            delete s;
+            CLASS copy = *static_cast<const CLASS*>(this);
+            copy.base.concat(fl.base);
             return copy;
         }
 
@@ -1110,17 +1161,14 @@ namespace DarcsPatch {
             for (; b != e; ++b) {
                 if (b == p) {
                     r = b;
-                    copy.base->emplace(item);
+                    copy.base.emplace(item);
                 }
-                copy.base->emplace(*b);
+                copy.base.emplace(*b);
             }
             if (e == p) {
                 r = const_iterator(e.origin[0], e.index);
-                copy.base->emplace(item);
+                copy.base.emplace(item);
             }
-            auto s = copy.base->slice(0, slice->get_end()+1);
-            *copy.slice = *s;
-            delete s;
             return {copy, r};
         }
 
@@ -1139,15 +1187,12 @@ namespace DarcsPatch {
                 if (b == p) {
                     r = b;
                     for(const T & item : fl) {
-                        copy.base->emplace(item);
+                        copy.base.emplace(item);
                         e++;
                     }
                 }
-                copy.base->emplace(*b);
+                copy.base.emplace(*b);
             }
-            auto s = copy.base->slice(0, slice->get_end()+fl.size());
-            *copy.slice = *s;
-            delete s;
             return {copy, r};
         }
 
@@ -1165,12 +1210,9 @@ namespace DarcsPatch {
                 if (b == p) {
                     r = b+1;
                 } else {
-                    copy.base->emplace(*b);
+                    copy.base.emplace(*b);
                 }
             }
-            auto s = copy.base->slice(0, slice->get_end()-1);
-            *copy.slice = *s;
-            delete s;
             return {copy, r};
         }
 
@@ -1194,12 +1236,9 @@ namespace DarcsPatch {
                 if (b >= first && b < last) {
                     r = b+1;
                 } else {
-                    copy.base->emplace(*b);
+                    copy.base.emplace(*b);
                 }
             }
-            auto s = copy.base->slice(0, slice->get_end()-(iterator_last - iterator_first));
-            *copy.slice = *s;
-            delete s;
             return {copy, r};
         }
 
@@ -1237,15 +1276,9 @@ namespace DarcsPatch {
         }
 
         void extract(T & out_a, FL<T> & out_fl) const {
-            if (base != out_fl.base) {
-                auto e = slice->begin();
-                auto & eo = *e;
-                out_a = eo;
-                out_fl.base = base;
-                auto s = base->slice(slice->get_start()+1, slice->get_end());
-                *out_fl.slice = *s;
-                delete s;
-            }
+            FL<T> rest = *this;
+            rest.base.pop(out_a);
+            out_fl = std::move(rest);
         }
     };
 
@@ -1270,15 +1303,9 @@ namespace DarcsPatch {
         }
 
         void extract(T & out_a, RL<T> & out_rl) const {
-            if (base != out_rl.base) {
-                auto e = end()-1;
-                auto & eo = *e;
-                out_a = eo;
-                out_rl.base = base;
-                auto s = base->slice(slice->get_start(), slice->get_end()-1);
-                *out_rl.slice = *s;
-                delete s;
-            }
+            RL<T> rest = *this;
+            rest.base.pop(out_a);
+            out_rl = std::move(rest);
         }
     };
 
@@ -1394,18 +1421,18 @@ namespace DarcsPatch {
 
     template <typename T>
     static const FL<T> ToFL(const std::vector<T> & vec) {
-        FL<T> fl;
-        // avoid recursion
-        for (const T & item : vec) fl = fl.push(item);
-        return fl;
+        typename FL<T>::Builder fl;
+        fl.reserve(vec.size());
+        for (const T & item : vec) fl.push(item);
+        return fl.freeze();
     }
 
     template <typename T>
     static const FL<T> ToFL(const RL<T> & rl) {
-        FL<T> fl;
-        // avoid recursion
-        for (const T & item : rl) fl = fl.push(item);
-        return fl;
+        typename FL<T>::Builder fl;
+        fl.reserve(rl.size());
+        for (const T & item : rl) fl.push(item);
+        return fl.freeze();
     }
 
     template <typename T>
@@ -1415,34 +1442,40 @@ namespace DarcsPatch {
 
     template <typename T>
     static const RL<T> ToRL(const std::vector<T> & vec) {
-        RL<T> rl;
-        // avoid recursion
-        for (const T & item : vec) rl = rl.push(item);
-        return rl;
+        typename RL<T>::Builder rl;
+        rl.reserve(vec.size());
+        for (const T & item : vec) rl.push(item);
+        return rl.freeze();
     }
 
     template <typename T>
     static const RL<T> ToRL(const FL<T> & fl) {
-        // avoid recursion
-        RL<T> rl;
-        for (const T & item : fl) rl = rl.push(item);
-        return rl;
+        typename RL<T>::Builder rl;
+        rl.reserve(fl.size());
+        for (const T & item : fl) rl.push(item);
+        return rl.freeze();
     }
 
     struct Nothing {};
 
     template <typename T>
     struct Maybe :
-        public StringAdapter::Comparable<Maybe<T>>,
-        public StringAdapter::Hashable<Maybe<T>>
+        public StaticComparable<Maybe<T>>,
+        public StaticHashable<Maybe<T>>
     {
         using THIS = Maybe<T>;
-        COMPARABLE_USING_BASE(StringAdapter::Comparable<THIS>);
-        HASHABLE_USING_BASE(StringAdapter::Hashable<THIS>);
+        STATIC_COMPARABLE_USING_BASE(StaticComparable<THIS>);
+        STATIC_HASHABLE_USING_BASE(StaticHashable<THIS>);
+
+        static int compare(const THIS & a, const THIS & b) {
+            return StringAdapter::compare_3(a, b, &THIS::has_value, &THIS::value);
+        }
+
+        static std::size_t hash(const THIS & a) {
+            return StringAdapter::hash_3(a, &THIS::has_value, &THIS::value);
+        }
 
         Maybe() :
-            THIS::Comparable([](auto & a, auto & b) { return StringAdapter::compare_3(a, b, &THIS::has_value, &THIS::value); }),
-            THIS::Hashable([](auto & a) { return StringAdapter::hash_3(a, &THIS::has_value, &THIS::value); }),
             has_value(false)
         {}
 
@@ -1458,14 +1491,10 @@ namespace DarcsPatch {
         }
 
         Maybe(const Nothing & nothing) :
-            THIS::Comparable([](auto & a, auto & b) { return StringAdapter::compare_3(a, b, &THIS::has_value, &THIS::value); }),
-            THIS::Hashable([](auto & a) { return StringAdapter::hash_3(a, &THIS::has_value, &THIS::value); }),
             has_value(false)
         {}
 
         Maybe(const T & value) :
-            THIS::Comparable([](auto & a, auto & b) { return StringAdapter::compare_3(a, b, &THIS::has_value, &THIS::value); }),
-            THIS::Hashable([](auto & a) { return StringAdapter::hash_3(a, &THIS::has_value, &THIS::value); }),
             has_value(true),
             value(value)
         {
@@ -1541,21 +1570,759 @@ namespace DarcsPatch {
 
 namespace DarcsPatch {
 
+    // persistent weight balanced search tree, the structure behind Haskell's
+    // Data.Set and Data.Map, used as the default backend of Set and Map
+    //
+    // nodes are immutable and shared between versions, so copying a tree is
+    // O(1), insert copies only the O(log n) nodes on the path to the new
+    // item and Union reuses every subtree the two trees already share.
+    //
+    // as with std::set and std::map, inserting a key that is already present
+    // leaves the tree unchanged.
+    //
+    template <typename KEY, typename VALUE, typename KEY_OF>
+    class PersistentTree {
+        struct Node;
+        using NodePtr = std::shared_ptr<const Node>;
+
+        struct Node {
+            VALUE value;
+            NodePtr left;
+            NodePtr right;
+            std::size_t size;
+
+            Node(const VALUE & value, const NodePtr & left, const NodePtr & right) :
+                value(value), left(left), right(right), size(1 + size_of(left) + size_of(right))
+            {}
+        };
+
+        static constexpr std::size_t DELTA = 3;
+        static constexpr std::size_t RATIO = 2;
+
+        static std::size_t size_of(const NodePtr & node) {
+            return node ? node->size : 0;
+        }
+
+        static const KEY & key_of(const NodePtr & node) {
+            return KEY_OF::key(node->value);
+        }
+
+        static NodePtr make(const VALUE & value, const NodePtr & left, const NodePtr & right) {
+            return std::make_shared<const Node>(value, left, right);
+        }
+
+        // rebalances a node whose children were balanced before one of them
+        // gained or lost a single item
+        static NodePtr balance(const VALUE & value, const NodePtr & left, const NodePtr & right) {
+            const std::size_t sl = size_of(left);
+            const std::size_t sr = size_of(right);
+            if (sl + sr <= 1) {
+                return make(value, left, right);
+            }
+            if (sr > DELTA * sl) {
+                if (size_of(right->left) < RATIO * size_of(right->right)) {
+                    return make(right->value, make(value, left, right->left), right->right);
+                }
+                const NodePtr & rl = right->left;
+                return make(rl->value, make(value, left, rl->left), make(right->value, rl->right, right->right));
+            }
+            if (sl > DELTA * sr) {
+                if (size_of(left->right) < RATIO * size_of(left->left)) {
+                    return make(left->value, left->left, make(value, left->right, right));
+                }
+                const NodePtr & lr = left->right;
+                return make(lr->value, make(left->value, left->left, lr->left), make(value, lr->right, right));
+            }
+            return make(value, left, right);
+        }
+
+        static NodePtr insert_node(const NodePtr & node, const VALUE & value) {
+            if (!node) {
+                return make(value, nullptr, nullptr);
+            }
+            const KEY & key = KEY_OF::key(value);
+            if (key < key_of(node)) {
+                NodePtr left = insert_node(node->left, value);
+                return left == node->left ? node : balance(node->value, left, node->right);
+            }
+            if (key_of(node) < key) {
+                NodePtr right = insert_node(node->right, value);
+                return right == node->right ? node : balance(node->value, node->left, right);
+            }
+            return node;
+        }
+
+        static NodePtr insert_min(const NodePtr & node, const VALUE & value) {
+            if (!node) {
+                return make(value, nullptr, nullptr);
+            }
+            return balance(node->value, insert_min(node->left, value), node->right);
+        }
+
+        static NodePtr insert_max(const NodePtr & node, const VALUE & value) {
+            if (!node) {
+                return make(value, nullptr, nullptr);
+            }
+            return balance(node->value, node->left, insert_max(node->right, value));
+        }
+
+        // every key in left is less than value's key and every key in right
+        // is greater
+        static NodePtr link(const VALUE & value, const NodePtr & left, const NodePtr & right) {
+            if (!left) {
+                return insert_min(right, value);
+            }
+            if (!right) {
+                return insert_max(left, value);
+            }
+            if (DELTA * left->size < right->size) {
+                return balance(right->value, link(value, left, right->left), right->right);
+            }
+            if (DELTA * right->size < left->size) {
+                return balance(left->value, left->left, link(value, left->right, right));
+            }
+            return make(value, left, right);
+        }
+
+        // splits node into the items whose keys are less than and greater
+        // than key, an item with an equal key is dropped
+        static void split(const NodePtr & node, const KEY & key, NodePtr & less, NodePtr & greater) {
+            if (!node) {
+                less = nullptr;
+                greater = nullptr;
+            } else if (key < key_of(node)) {
+                NodePtr greater_left;
+                split(node->left, key, less, greater_left);
+                greater = link(node->value, greater_left, node->right);
+            } else if (key_of(node) < key) {
+                NodePtr less_right;
+                split(node->right, key, less_right, greater);
+                less = link(node->value, node->left, less_right);
+            } else {
+                less = node->left;
+                greater = node->right;
+            }
+        }
+
+        // where both trees have an item with the same key the one in a is kept
+        static NodePtr union_nodes(const NodePtr & a, const NodePtr & b) {
+            if (!b || a == b) {
+                return a;
+            }
+            if (!a) {
+                return b;
+            }
+            NodePtr less;
+            NodePtr greater;
+            split(b, key_of(a), less, greater);
+            return link(a->value, union_nodes(a->left, less), union_nodes(a->right, greater));
+        }
+
+        NodePtr root;
+
+        public:
+
+        using key_type = KEY;
+        using value_type = VALUE;
+        using size_type = std::size_t;
+
+        class const_iterator {
+            friend class PersistentTree;
+
+            const Node * root = nullptr;
+            // the nodes from the root down to the current one, empty at end()
+            std::vector<const Node *> path;
+
+            const_iterator(const Node * root) : root(root) {}
+
+            void descend_left(const Node * node) {
+                for (; node != nullptr; node = node->left.get()) {
+                    path.push_back(node);
+                }
+            }
+
+            void descend_right(const Node * node) {
+                for (; node != nullptr; node = node->right.get()) {
+                    path.push_back(node);
+                }
+            }
+
+            public:
+
+            using iterator_category = std::bidirectional_iterator_tag;
+            using value_type = VALUE;
+            using difference_type = std::ptrdiff_t;
+            using pointer = const VALUE *;
+            using reference = const VALUE &;
+
+            const_iterator() = default;
+
+            reference operator*() const {
+                return path.back()->value;
+            }
+
+            pointer operator->() const {
+                return &path.back()->value;
+            }
+
+            const_iterator & operator++() {
+                const Node * node = path.back();
+                if (node->right) {
+                    descend_left(node->right.get());
+                    return *this;
+                }
+                // climb out of every right subtree we are the last item of
+                path.pop_back();
+                while (!path.empty() && path.back()->right.get() == node) {
+                    node = path.back();
+                    path.pop_back();
+                }
+                return *this;
+            }
+
+            const_iterator & operator--() {
+                if (path.empty()) {
+                    descend_right(root);
+                    return *this;
+                }
+                const Node * node = path.back();
+                if (node->left) {
+                    descend_right(node->left.get());
+                    return *this;
+                }
+                path.pop_back();
+                while (!path.empty() && path.back()->left.get() == node) {
+                    node = path.back();
+                    path.pop_back();
+                }
+                return *this;
+            }
+
+            const_iterator operator++(int) {
+                const_iterator copy = *this;
+                ++*this;
+                return copy;
+            }
+
+            const_iterator operator--(int) {
+                const_iterator copy = *this;
+                --*this;
+                return copy;
+            }
+
+            bool operator == (const const_iterator & other) const {
+                if (path.empty() || other.path.empty()) {
+                    return path.empty() && other.path.empty();
+                }
+                return path.back() == other.path.back();
+            }
+
+            bool operator != (const const_iterator & other) const {
+                return !(*this == other);
+            }
+        };
+
+        // items are immutable once inserted
+        using iterator = const_iterator;
+        using reverse_iterator = std::reverse_iterator<const_iterator>;
+        using const_reverse_iterator = reverse_iterator;
+
+        const_iterator begin() const {
+            const_iterator it(root.get());
+            it.descend_left(root.get());
+            return it;
+        }
+
+        const_iterator end() const {
+            return const_iterator(root.get());
+        }
+
+        const_iterator cbegin() const {
+            return begin();
+        }
+
+        const_iterator cend() const {
+            return end();
+        }
+
+        reverse_iterator rbegin() const {
+            return reverse_iterator(end());
+        }
+
+        reverse_iterator rend() const {
+            return reverse_iterator(begin());
+        }
+
+        reverse_iterator crbegin() const {
+            return rbegin();
+        }
+
+        reverse_iterator crend() const {
+            return rend();
+        }
+
+        std::size_t size() const {
+            return size_of(root);
+        }
+
+        bool empty() const {
+            return !root;
+        }
+
+        void insert(const VALUE & value) {
+            root = insert_node(root, value);
+        }
+
+        // the item with the given key, or nullptr
+        const VALUE * get(const KEY & key) const {
+            const Node * node = root.get();
+            while (node != nullptr) {
+                const KEY & k = KEY_OF::key(node->value);
+                if (key < k) {
+                    node = node->left.get();
+                } else if (k < key) {
+                    node = node->right.get();
+                } else {
+                    return &node->value;
+                }
+            }
+            return nullptr;
+        }
+
+        std::size_t count(const KEY & key) const {
+            return get(key) != nullptr ? 1 : 0;
+        }
+
+        const_iterator find(const KEY & key) const {
+            const_iterator it(root.get());
+            const Node * node = root.get();
+            while (node != nullptr) {
+                it.path.push_back(node);
+                const KEY & k = KEY_OF::key(node->value);
+                if (key < k) {
+                    node = node->left.get();
+                } else if (k < key) {
+                    node = node->right.get();
+                } else {
+                    return it;
+                }
+            }
+            return end();
+        }
+
+        // O(m log(n / m + 1)) for trees of m <= n items, and O(1) for trees
+        // that share their root
+        static PersistentTree Union(const PersistentTree & a, const PersistentTree & b) {
+            PersistentTree tree;
+            tree.root = union_nodes(a.root, b.root);
+            return tree;
+        }
+    };
+
+    struct PersistentTreeKeyIsValue {
+        template <typename T>
+        static const T & key(const T & value) {
+            return value;
+        }
+    };
+
+    struct PersistentTreeKeyIsFirst {
+        template <typename PAIR>
+        static const typename PAIR::first_type & key(const PAIR & value) {
+            return value.first;
+        }
+    };
+
     template <typename T>
+    using PersistentSet = PersistentTree<T, T, PersistentTreeKeyIsValue>;
+
+    template <typename K, typename V>
+    using PersistentMap = PersistentTree<K, std::pair<const K, V>, PersistentTreeKeyIsFirst>;
+
+    // compressed set of 32 bit ids, laid out like a roaring bitmap
+    //
+    // ids are split into blocks of 2^16 by their high half. a block keeps a
+    // sorted array of its low halves while it is sparse and switches to a
+    // 65536 bit bitmap once it holds more than ARRAY_MAX ids, so a union of
+    // two dense blocks is 1024 word wide ORs.
+    //
+    // blocks and the block list are immutable and shared between copies,
+    // copying is O(1) and a union reuses every block it leaves unchanged.
+    //
+    class CompressedBitset {
+        static constexpr std::size_t ARRAY_MAX = 4096;
+        static constexpr std::size_t BLOCK_BITS = 65536;
+        static constexpr std::size_t WORDS = BLOCK_BITS / 64;
+
+        static std::size_t lowest_bit(const uint64_t word) {
+#if defined(__GNUC__) || defined(__clang__)
+            return __builtin_ctzll(word);
+#else
+            std::size_t bit = 0;
+            while (((word >> bit) & 1) == 0) bit++;
+            return bit;
+#endif
+        }
+
+        static std::size_t count_bits(uint64_t word) {
+#if defined(__GNUC__) || defined(__clang__)
+            return __builtin_popcountll(word);
+#else
+            std::size_t count = 0;
+            for (; word != 0; word &= word - 1) count++;
+            return count;
+#endif
+        }
+
+        struct Block {
+            std::vector<uint16_t> array;
+            std::vector<uint64_t> bitmap;
+            std::size_t cardinality = 0;
+
+            bool is_bitmap() const {
+                return !bitmap.empty();
+            }
+
+            bool contains(const uint16_t low) const {
+                if (is_bitmap()) {
+                    return (bitmap[low >> 6] >> (low & 63)) & 1;
+                }
+                return std::binary_search(array.begin(), array.end(), low);
+            }
+
+            // the first position at or after `from`, BLOCK_BITS if there is
+            // none. positions index array, or are bits of bitmap
+            std::size_t next(const std::size_t from) const {
+                if (!is_bitmap()) {
+                    return from < array.size() ? from : BLOCK_BITS;
+                }
+                std::size_t word = from >> 6;
+                if (word >= WORDS) {
+                    return BLOCK_BITS;
+                }
+                uint64_t bits = bitmap[word] & (~uint64_t(0) << (from & 63));
+                while (bits == 0) {
+                    if (++word == WORDS) {
+                        return BLOCK_BITS;
+                    }
+                    bits = bitmap[word];
+                }
+                return word * 64 + lowest_bit(bits);
+            }
+
+            uint16_t at(const std::size_t position) const {
+                return is_bitmap() ? (uint16_t) position : array[position];
+            }
+
+            void to_bitmap() {
+                bitmap.assign(WORDS, 0);
+                for (const uint16_t low : array) {
+                    bitmap[low >> 6] |= uint64_t(1) << (low & 63);
+                }
+                array.clear();
+                array.shrink_to_fit();
+            }
+        };
+
+        using BlockPtr = std::shared_ptr<const Block>;
+
+        struct Entry {
+            uint16_t key;
+            BlockPtr block;
+        };
+
+        static bool is_subset(const BlockPtr & a, const BlockPtr & b) {
+            if (a == b) {
+                return true;
+            }
+            if (a->cardinality > b->cardinality) {
+                return false;
+            }
+            if (!a->is_bitmap() && !b->is_bitmap()) {
+                return std::includes(b->array.begin(), b->array.end(), a->array.begin(), a->array.end());
+            }
+            if (!a->is_bitmap()) {
+                for (const uint16_t low : a->array) {
+                    if (!b->contains(low)) {
+                        return false;
+                    }
+                }
+                return true;
+            }
+            if (!b->is_bitmap()) {
+                return false;
+            }
+            for (std::size_t i = 0; i < WORDS; i++) {
+                if ((a->bitmap[i] & ~b->bitmap[i]) != 0) {
+                    return false;
+                }
+            }
+            return true;
+        }
+
+        static BlockPtr unite(const BlockPtr & a, const BlockPtr & b) {
+            auto block = std::make_shared<Block>();
+            if (!a->is_bitmap() && !b->is_bitmap()) {
+                block->array.reserve(a->cardinality + b->cardinality);
+                std::set_union(a->array.begin(), a->array.end(), b->array.begin(), b->array.end(), std::back_inserter(block->array));
+                block->cardinality = block->array.size();
+                if (block->cardinality > ARRAY_MAX) {
+                    block->to_bitmap();
+                }
+            } else {
+                const Block * dense = a->is_bitmap() ? a.get() : b.get();
+                const Block * other = a->is_bitmap() ? b.get() : a.get();
+                block->bitmap = dense->bitmap;
+                if (other->is_bitmap()) {
+                    for (std::size_t i = 0; i < WORDS; i++) {
+                        block->bitmap[i] |= other->bitmap[i];
+                    }
+                } else {
+                    for (const uint16_t low : other->array) {
+                        block->bitmap[low >> 6] |= uint64_t(1) << (low & 63);
+                    }
+                }
+                for (const uint64_t word : block->bitmap) {
+                    block->cardinality += count_bits(word);
+                }
+            }
+            return block;
+        }
+
+        std::shared_ptr<const std::vector<Entry>> blocks;
+        std::size_t size_ = 0;
+
+        // every id of a is in b
+        static bool is_subset(const CompressedBitset & a, const CompressedBitset & b) {
+            if (a.size_ == 0 || a.blocks == b.blocks) {
+                return true;
+            }
+            if (a.size_ > b.size_) {
+                return false;
+            }
+            for (const Entry & e : *a.blocks) {
+                const Entry * other = b.find_block(e.key);
+                if (other == nullptr || !is_subset(e.block, other->block)) {
+                    return false;
+                }
+            }
+            return true;
+        }
+
+        const Entry * find_block(const uint16_t key) const {
+            if (!blocks) {
+                return nullptr;
+            }
+            auto it = std::lower_bound(blocks->begin(), blocks->end(), key, [](const Entry & e, const uint16_t k) { return e.key < k; });
+            return it != blocks->end() && it->key == key ? &*it : nullptr;
+        }
+
+        public:
+
+        class const_iterator {
+            friend class CompressedBitset;
+
+            const std::vector<Entry> * blocks = nullptr;
+            std::size_t block = 0;
+            std::size_t position = 0;
+
+            const_iterator(const std::vector<Entry> * blocks, const std::size_t block) : blocks(blocks), block(block) {
+                if (blocks != nullptr && block < blocks->size()) {
+                    position = (*blocks)[block].block->next(0);
+                }
+            }
+
+            public:
+
+            using iterator_category = std::forward_iterator_tag;
+            using value_type = uint32_t;
+            using difference_type = std::ptrdiff_t;
+            using pointer = const uint32_t *;
+            using reference = uint32_t;
+
+            const_iterator() = default;
+
+            uint32_t operator*() const {
+                const Entry & e = (*blocks)[block];
+                return (uint32_t(e.key) << 16) | e.block->at(position);
+            }
+
+            const_iterator & operator++() {
+                position = (*blocks)[block].block->next(position + 1);
+                if (position == BLOCK_BITS) {
+                    block++;
+                    position = block < blocks->size() ? (*blocks)[block].block->next(0) : 0;
+                }
+                return *this;
+            }
+
+            const_iterator operator++(int) {
+                const_iterator copy = *this;
+                ++*this;
+                return copy;
+            }
+
+            bool operator == (const const_iterator & other) const {
+                return block == other.block && position == other.position;
+            }
+
+            bool operator != (const const_iterator & other) const {
+                return !(*this == other);
+            }
+        };
+
+        const_iterator begin() const {
+            return const_iterator(blocks.get(), 0);
+        }
+
+        const_iterator end() const {
+            return const_iterator(blocks.get(), blocks ? blocks->size() : 0);
+        }
+
+        std::size_t size() const {
+            return size_;
+        }
+
+        bool contains(const uint32_t id) const {
+            const Entry * e = find_block(id >> 16);
+            return e != nullptr && e->block->contains(id & 0xFFFF);
+        }
+
+        void insert(const uint32_t id) {
+            const uint16_t key = id >> 16;
+            const uint16_t low = id & 0xFFFF;
+            const Entry * e = find_block(key);
+            if (e != nullptr && e->block->contains(low)) {
+                return;
+            }
+            auto block = std::make_shared<Block>();
+            if (e == nullptr) {
+                block->array.push_back(low);
+            } else if (e->block->is_bitmap()) {
+                block->bitmap = e->block->bitmap;
+                block->bitmap[low >> 6] |= uint64_t(1) << (low & 63);
+            } else {
+                block->array = e->block->array;
+                block->array.insert(std::lower_bound(block->array.begin(), block->array.end(), low), low);
+            }
+            block->cardinality = e == nullptr ? 1 : e->block->cardinality + 1;
+            if (!block->is_bitmap() && block->cardinality > ARRAY_MAX) {
+                block->to_bitmap();
+            }
+            auto new_blocks = blocks ? std::make_shared<std::vector<Entry>>(*blocks) : std::make_shared<std::vector<Entry>>();
+            auto it = std::lower_bound(new_blocks->begin(), new_blocks->end(), key, [](const Entry & e, const uint16_t k) { return e.key < k; });
+            if (it != new_blocks->end() && it->key == key) {
+                it->block = block;
+            } else {
+                new_blocks->insert(it, Entry { key, block });
+            }
+            blocks = new_blocks;
+            size_++;
+        }
+
+        // returns a or b itself when the other adds nothing to it
+        static CompressedBitset Union(const CompressedBitset & a, const CompressedBitset & b) {
+            if (is_subset(b, a)) {
+                return a;
+            }
+            if (is_subset(a, b)) {
+                return b;
+            }
+            auto blocks = std::make_shared<std::vector<Entry>>();
+            blocks->reserve(a.blocks->size() + b.blocks->size());
+            CompressedBitset r;
+            auto ia = a.blocks->begin();
+            auto ib = b.blocks->begin();
+            while (ia != a.blocks->end() || ib != b.blocks->end()) {
+                if (ib == b.blocks->end() || (ia != a.blocks->end() && ia->key < ib->key)) {
+                    blocks->push_back(*ia++);
+                } else if (ia == a.blocks->end() || ib->key < ia->key) {
+                    blocks->push_back(*ib++);
+                } else if (is_subset(ib->block, ia->block)) {
+                    blocks->push_back(*ia++);
+                    ib++;
+                } else if (is_subset(ia->block, ib->block)) {
+                    blocks->push_back(*ib++);
+                    ia++;
+                } else {
+                    blocks->push_back(Entry { ia->key, unite(ia->block, ib->block) });
+                    ia++;
+                    ib++;
+                }
+                r.size_ += blocks->back().block->cardinality;
+            }
+            r.blocks = blocks;
+            return r;
+        }
+    };
+
+    template <typename SET_T>
+    struct SetIsHashed : std::false_type {};
+
+    template <typename... Ts>
+    struct SetIsHashed<std::unordered_set<Ts...>> : std::true_type {};
+
+    template <typename SET_T>
+    struct SetIsPersistent : std::false_type {};
+
+    template <typename... Ts>
+    struct SetIsPersistent<PersistentTree<Ts...>> : std::true_type {};
+
+    // SET_T is the backend, a PersistentSet by default, std::set, or
+    // std::unordered_set (see HashSet) for types whose std::hash is cheaper
+    // than their ordering
+    template <typename T, typename SET_T = PersistentSet<T>>
     struct Set :
-        public StringAdapter::Comparable<Set<T>>,
-        public StringAdapter::Hashable<Set<T>>
+        public StaticComparable<Set<T, SET_T>>,
+        public StaticHashable<Set<T, SET_T>>
     {
-        using THIS = Set<T>;
-        COMPARABLE_USING_BASE(StringAdapter::Comparable<THIS>);
-        HASHABLE_USING_BASE(StringAdapter::Hashable<THIS>);
+        using THIS = Set<T, SET_T>;
+        STATIC_COMPARABLE_USING_BASE(StaticComparable<THIS>);
+        STATIC_HASHABLE_USING_BASE(StaticHashable<THIS>);
+
+        static constexpr bool HASHED = SetIsHashed<SET_T>::value;
+        static constexpr bool PERSISTENT = SetIsPersistent<SET_T>::value;
+
+        // a hashed set has no order of its own, so it is compared by size and
+        // then by its items in sorted order, and hashed order independently
+        static int compare(const THIS & a, const THIS & b) {
+            if constexpr (HASHED) {
+                if (a.size() != b.size()) {
+                    return a.size() < b.size() ? -1 : 1;
+                }
+                if (a.set == b.set) {
+                    return 0;
+                }
+                std::vector<T> sa(a.cbegin(), a.cend());
+                std::vector<T> sb(b.cbegin(), b.cend());
+                std::sort(sa.begin(), sa.end());
+                std::sort(sb.begin(), sb.end());
+                for (std::size_t i = 0; i < sa.size(); i++) {
+                    int r = StringAdapter::compare_2(sa[i], sb[i]);
+                    if (r != 0) {
+                        return r;
+                    }
+                }
+                return 0;
+            } else {
+                return StringAdapter::compare_3_iterator(a, b, &THIS::cbegin, &THIS::cend);
+            }
+        }
 
-        Set() :
-            THIS::Comparable([](auto & a, auto & b) { return StringAdapter::compare_3_iterator(a, b, &THIS::cbegin, &THIS::cend); }),
-            THIS::Hashable([](auto & a) { return StringAdapter::hash_3_iterator<THIS, T>(a); })
-        {}
+        static std::size_t hash(const THIS & a) {
+            if constexpr (HASHED) {
+                // https://docs.oracle.com/javase/8/docs/api/java/util/Set.html#hashCode--
+                std::size_t hashCode_ = 0;
+                for (const T & item : a.set) {
+                    hashCode_ += std::hash<T>()(item);
+                }
+                return hashCode_;
+            } else {
+                return StringAdapter::hash_3_iterator<THIS, T>(a);
+            }
+        }
 
-        using SET_T = std::set<T>;
+        Set() {}
 
         SET_T set;
 
@@ -1591,27 +2358,35 @@ namespace DarcsPatch {
             return cend();
         }
 
-        typename SET_T::reverse_iterator rbegin() {
+        // reverse iteration only exists for the ordered backend
+
+        template <typename S = SET_T>
+        typename S::reverse_iterator rbegin() {
             return set.rbegin();
         }
 
-        typename SET_T::reverse_iterator rend() {
+        template <typename S = SET_T>
+        typename S::reverse_iterator rend() {
             return set.rend();
         }
 
-        typename SET_T::const_reverse_iterator crbegin() const {
+        template <typename S = SET_T>
+        typename S::const_reverse_iterator crbegin() const {
             return set.crbegin();
         }
 
-        typename SET_T::const_reverse_iterator crend() const {
+        template <typename S = SET_T>
+        typename S::const_reverse_iterator crend() const {
             return set.crend();
         }
 
-        typename SET_T::const_reverse_iterator rbegin() const {
+        template <typename S = SET_T>
+        typename S::const_reverse_iterator rbegin() const {
             return crbegin();
         }
 
-        typename SET_T::const_reverse_iterator rend() const {
+        template <typename S = SET_T>
+        typename S::const_reverse_iterator rend() const {
             return crend();
         }
 
@@ -1619,33 +2394,41 @@ namespace DarcsPatch {
             return set.size();
         }
 
-        Set<T> & insert_in_place(const T & item) {
+        THIS & insert_in_place(const T & item) {
             set.insert(item);
             return *this;
         }
 
-        const Set<T> insert(const T & item) const {
-            Set<T> copy = *this;
+        const THIS insert(const T & item) const {
+            THIS copy = *this;
             copy.insert_in_place(item);
             return copy;
         }
 
+        // O(log n) for ordered backends, O(1) expected for std::unordered_set
         const bool contains(const T & item) const {
-            for(const T & v : set) {
-                if (v == item) return true;
-            }
-            return false;
+            return set.count(item) != 0;
         }
 
-        const Set<T> Union(const Set<T> & other) const {
-            Set<T> s;
-            std::set_union(set.cbegin(), set.cend(), other.set.cbegin(), other.set.cend(), std::inserter(s.set, s.cend()));
+        const THIS Union(const THIS & other) const {
+            THIS s;
+            if constexpr (HASHED) {
+                s.set = set;
+                s.set.insert(other.set.cbegin(), other.set.cend());
+            } else if constexpr (PERSISTENT) {
+                s.set = SET_T::Union(set, other.set);
+            } else {
+                std::set_union(set.cbegin(), set.cend(), other.set.cbegin(), other.set.cend(), std::inserter(s.set, s.cend()));
+            }
             return s;
         }
     };
 
     template <typename T>
-    ::std::ostream& operator <<(::std::ostream& os, const DarcsPatch::Set<T> & item) {
+    using HashSet = Set<T, std::unordered_set<T>>;
+
+    template <typename T, typename SET_T>
+    ::std::ostream& operator <<(::std::ostream& os, const DarcsPatch::Set<T, SET_T> & item) {
         auto b = item.begin();
         auto e = item.end();
         if (b == e) {
@@ -1654,20 +2437,18 @@ namespace DarcsPatch {
         os << "[ ";
         for (; b != e; ++b) {
             os << *b;
-            b++;
-            if (b != e) {
+            if (std::next(b) != e) {
                 os << ", ";
             } else {
                 os << " ";
             }
-            b--;
         }
         os << "]";
         return os;
     }
 
-    template <typename T>
-    ::std::ostream& operator <<(::std::ostream& os, const DarcsPatch::Set<T*> & item) {
+    template <typename T, typename SET_T>
+    ::std::ostream& operator <<(::std::ostream& os, const DarcsPatch::Set<T*, SET_T> & item) {
         auto b = item.begin();
         auto e = item.end();
         if (b == e) {
@@ -1676,13 +2457,11 @@ namespace DarcsPatch {
         os << "[ ";
         for (; b != e; ++b) {
             os << **b;
-            b++;
-            if (b != e) {
+            if (std::next(b) != e) {
                 os << ", ";
             } else {
                 os << " ";
             }
-            b--;
         }
         os << "]";
         return os;
@@ -1693,17 +2472,22 @@ namespace DarcsPatch {
 
     template <typename K, typename V>
     struct Map :
-        public StringAdapter::Comparable<Map<K, V>>,
-        public StringAdapter::Hashable<Map<K, V>>
+        public StaticComparable<Map<K, V>>,
+        public StaticHashable<Map<K, V>>
     {
         using THIS = Map<K, V>;
-        COMPARABLE_USING_BASE(StringAdapter::Comparable<THIS>);
-        HASHABLE_USING_BASE(StringAdapter::Hashable<THIS>);
+        STATIC_COMPARABLE_USING_BASE(StaticComparable<THIS>);
+        STATIC_HASHABLE_USING_BASE(StaticHashable<THIS>);
 
-        Map() :
-            THIS::Comparable([](auto & a, auto & b) { return StringAdapter::compare_3_iterator(a, b, &THIS::cbegin, &THIS::cend); }),
-            THIS::Hashable([](auto & a) { return StringAdapter::hash_3_iterator<THIS, Tuple2<const K, V>>(a); })
-        {}
+        static int compare(const THIS & a, const THIS & b) {
+            return StringAdapter::compare_3_iterator(a, b, &THIS::cbegin, &THIS::cend);
+        }
+
+        static std::size_t hash(const THIS & a) {
+            return StringAdapter::hash_3_iterator<THIS, Tuple2<const K, V>>(a);
+        }
+
+        Map() {}
 
         // we cannot use std::map due to it requiring comparison operators
         // we cannot use std::unordered_map due to it requiring K to be hashable
@@ -1712,7 +2496,10 @@ namespace DarcsPatch {
         //
 
         // using MAP_T = std::vector<std::pair<K, V>>;
-        using MAP_T = std::map<K, V>;
+        // using MAP_T = std::map<K, V>;
+        //
+        // insert returns a new map, so share structure with the old one
+        using MAP_T = PersistentMap<K, V>;
 
         MAP_T map;
 
@@ -1788,11 +2575,11 @@ namespace DarcsPatch {
         }
 
         const bool contains(const K & key) const {
-            return map.contains(key);
+            return map.count(key) != 0;
         }
 
         const Maybe<V> lookup(const K & key) const {
-            if (auto search = map.find(key); search != map.end()) {
+            if (auto search = map.get(key)) {
                 return search->second;
             }
             return Nothing();
@@ -1924,12 +2711,344 @@ namespace DarcsPatch {
         using Patch::hashCode;
     };
 
-    struct RemoveFile : Patch {
-        const PATCH_TYPE type() const override;
-        std::shared_ptr<Patch> invert() const override;
-        ::std::ostream & to_stream(::std::ostream & os) const override;
-        using Patch::cmp;
-        using Patch::hashCode;
+    struct RemoveFile : Patch {
+        const PATCH_TYPE type() const override;
+        std::shared_ptr<Patch> invert() const override;
+        ::std::ostream & to_stream(::std::ostream & os) const override;
+        using Patch::cmp;
+        using Patch::hashCode;
+    };
+
+    // the characters a TokReplace token spec matches, as Commute::RegChars
+    // reads the spec, compiled to a 256 bit table when char_t is a byte and
+    // to sorted ranges otherwise
+    //
+    // as with RegChars an unsupported escape is only reported once a
+    // character that no earlier part of the spec matches is tested
+    //
+    template <typename char_t>
+    class TokChars {
+        std::uint64_t table[4] = {0, 0, 0, 0};
+        std::vector<std::pair<char_t, char_t>> ranges;
+        bool negated = false;
+        std::string error;
+
+        // for a byte char_t, the bytes of table as runs of first + 0 to
+        // first + span for the vector scans, which take at most 8 runs
+        static constexpr std::size_t MAX_RUNS = 8;
+        unsigned char run_first[MAX_RUNS];
+        unsigned char run_span[MAX_RUNS];
+        std::size_t runs = MAX_RUNS + 1;
+
+        bool in_table(const unsigned char b) const {
+            return (table[b >> 6] >> (b & 63)) & 1;
+        }
+
+        static std::size_t lowest_bit(const std::uint64_t word) {
+#if defined(__GNUC__) || defined(__clang__)
+            return __builtin_ctzll(word);
+#else
+            std::size_t bit = 0;
+            while (((word >> bit) & 1) == 0) bit++;
+            return bit;
+#endif
+        }
+
+        void find_runs() {
+            runs = 0;
+            for (int b = 0; b < 256;) {
+                if (!in_table(b)) {
+                    b++;
+                    continue;
+                }
+                int last = b;
+                while (last < 255 && in_table(last + 1)) last++;
+                if (runs == MAX_RUNS) {
+                    runs = MAX_RUNS + 1;
+                    return;
+                }
+                run_first[runs] = b;
+                run_span[runs] = last - b;
+                runs++;
+                b = last + 1;
+            }
+        }
+
+#ifdef DARCS_PATCH_X86_SIMD
+        // bit i of in is set when p[i] is in table, and bit i of firsts when
+        // p[i] is a or b, for the 64 bytes at p
+
+        void masks_sse2(const unsigned char * p, const unsigned char a, const unsigned char b, std::uint64_t & in, std::uint64_t & firsts) const {
+            in = 0;
+            firsts = 0;
+            for (int block = 0; block < 64; block += 16) {
+                const __m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p + block));
+                __m128i m = _mm_setzero_si128();
+                for (std::size_t r = 0; r < runs; r++) {
+                    const __m128i d = _mm_sub_epi8(x, _mm_set1_epi8(static_cast<char>(run_first[r])));
+                    m = _mm_or_si128(m, _mm_cmpeq_epi8(_mm_min_epu8(d, _mm_set1_epi8(static_cast<char>(run_span[r]))), d));
+                }
+                const __m128i f = _mm_or_si128(_mm_cmpeq_epi8(x, _mm_set1_epi8(static_cast<char>(a))), _mm_cmpeq_epi8(x, _mm_set1_epi8(static_cast<char>(b))));
+                in |= std::uint64_t(static_cast<std::uint16_t>(_mm_movemask_epi8(m))) << block;
+                firsts |= std::uint64_t(static_cast<std::uint16_t>(_mm_movemask_epi8(f))) << block;
+            }
+        }
+
+        __attribute__((target("avx2")))
+        void masks_avx2(const unsigned char * p, const unsigned char a, const unsigned char b, std::uint64_t & in, std::uint64_t & firsts) const {
+            in = 0;
+            firsts = 0;
+            for (int block = 0; block < 64; block += 32) {
+                const __m256i x = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(p + block));
+                __m256i m = _mm256_setzero_si256();
+                for (std::size_t r = 0; r < runs; r++) {
+                    const __m256i d = _mm256_sub_epi8(x, _mm256_set1_epi8(static_cast<char>(run_first[r])));
+                    m = _mm256_or_si256(m, _mm256_cmpeq_epi8(_mm256_min_epu8(d, _mm256_set1_epi8(static_cast<char>(run_span[r]))), d));
+                }
+                const __m256i f = _mm256_or_si256(_mm256_cmpeq_epi8(x, _mm256_set1_epi8(static_cast<char>(a))), _mm256_cmpeq_epi8(x, _mm256_set1_epi8(static_cast<char>(b))));
+                in |= std::uint64_t(static_cast<std::uint32_t>(_mm256_movemask_epi8(m))) << block;
+                firsts |= std::uint64_t(static_cast<std::uint32_t>(_mm256_movemask_epi8(f))) << block;
+            }
+        }
+
+        static bool has_avx2() {
+            static const bool avx2 = __builtin_cpu_supports("avx2");
+            return avx2;
+        }
+#endif
+
+        void add(const char_t & first, const char_t & last) {
+            if (last < first) {
+                return;
+            }
+            if constexpr (sizeof(char_t) == 1) {
+                for (int c = first; c <= last; c++) {
+                    const unsigned char b = static_cast<unsigned char>(c);
+                    table[b >> 6] |= std::uint64_t(1) << (b & 63);
+                }
+            } else {
+                ranges.emplace_back(first, last);
+            }
+        }
+
+        public:
+
+        // matches nothing, as an empty spec does
+        TokChars() {}
+
+        TokChars(const std::vector<char_t> & spec) {
+            std::size_t i = 0;
+            if (spec.size() != 0) {
+                char c0 = spec[0];
+                if (c0 == '^') {
+                    negated = true;
+                    i = 1;
+                } else if (c0 == '\\' && spec.size() > 1 && spec[1] == '^') {
+                    i = 1;
+                }
+            }
+
+            // unescapeChars
+            std::vector<char_t> cs;
+            cs.reserve(spec.size() - i);
+            for (; i < spec.size(); i++) {
+                char ch1 = spec[i];
+                if (ch1 == '\\' && i + 1 < spec.size()) {
+                    char ch2 = spec[i + 1];
+                    if (ch2 == 'n' || ch2 == 't' || ch2 == '^') {
+                        cs.push_back(ch2 == 'n' ? '\n' : ch2 == 't' ? '\t' : '^');
+                        i++;
+                        continue;
+                    }
+                }
+                cs.push_back(spec[i]);
+            }
+
+            // normalRegChars
+            for (std::size_t j = 0; j < cs.size();) {
+                const char_t c1 = cs[j];
+                char ch1 = c1;
+                if (ch1 == '\\' && j + 1 < cs.size()) {
+                    const char_t c2 = cs[j + 1];
+                    char ch2 = c2;
+                    if (ch2 == '.' || ch2 == '-' || ch2 == '\\') {
+                        add(c2, c2);
+                        j += 2;
+                        continue;
+                    }
+                    error = "'\\";
+                    error += ch2;
+                    error += "' not supported";
+                    break;
+                } else if (j + 2 < cs.size()) {
+                    char ch2 = cs[j + 1];
+                    if (ch2 == '-') {
+                        add(c1, cs[j + 2]);
+                        j += 3;
+                        continue;
+                    }
+                }
+                add(c1, c1);
+                j++;
+            }
+
+            if constexpr (sizeof(char_t) == 1) {
+                find_runs();
+            } else {
+                std::sort(ranges.begin(), ranges.end());
+                std::size_t merged = 0;
+                for (const auto & range : ranges) {
+                    if (merged != 0 && !(ranges[merged - 1].second < range.first)) {
+                        ranges[merged - 1].second = std::max(ranges[merged - 1].second, range.second);
+                    } else {
+                        ranges[merged++] = range;
+                    }
+                }
+                ranges.resize(merged);
+            }
+        }
+
+        bool operator()(const char_t & c) const {
+            bool found;
+            if constexpr (sizeof(char_t) == 1) {
+                const unsigned char b = static_cast<unsigned char>(c);
+                found = (table[b >> 6] >> (b & 63)) & 1;
+            } else {
+                auto range = std::upper_bound(ranges.begin(), ranges.end(), c, [](const char_t & a, const std::pair<char_t, char_t> & b) { return a < b.first; });
+                found = range != ranges.begin() && !((--range)->second < c);
+            }
+            if (found) {
+                return !negated;
+            }
+            if (!error.empty()) {
+                throw new std::runtime_error(error);
+            }
+            return negated;
+        }
+
+        // testing a character can throw, token_starts may not be used
+        bool can_throw() const {
+            return !error.empty();
+        }
+
+        bool operator==(const TokChars & other) const {
+            return std::equal(table, table + 4, other.table) && ranges == other.ranges && negated == other.negated && error == other.error;
+        }
+
+        bool operator!=(const TokChars & other) const {
+            return !(*this == other);
+        }
+
+        enum SCAN {
+            SCALAR, SSE2, AVX2, BEST
+        };
+
+        // calls f(i) for each i where a token, a run of token characters,
+        // starts with a or b in the size characters at p, in order, until f
+        // returns false
+        //
+        // 64 characters are tested at a time. only for a byte char_t, and
+        // only where testing a character can not throw. scan is the widest
+        // scan to use, which is only used where the cpu has it
+        //
+        template <typename F>
+        bool token_starts(const char_t * p, const std::size_t size, const char_t a, const char_t b, F && f, const SCAN scan = BEST) const {
+            static_assert(sizeof(char_t) == 1, "TokChars::token_starts scans bytes");
+            const unsigned char * bytes = reinterpret_cast<const unsigned char *>(p);
+            const std::uint64_t flip = negated ? ~std::uint64_t(0) : 0;
+            std::uint64_t carry = 0;
+            for (std::size_t block = 0; block < size; block += 64) {
+                std::uint64_t in = 0;
+                std::uint64_t firsts = 0;
+                const std::size_t count = std::min<std::size_t>(size - block, 64);
+                bool scanned = false;
+#ifdef DARCS_PATCH_X86_SIMD
+                if (count == 64 && runs <= MAX_RUNS) {
+                    if (scan >= AVX2 && has_avx2()) {
+                        masks_avx2(bytes + block, a, b, in, firsts);
+                        scanned = true;
+                    } else if (scan >= SSE2) {
+                        masks_sse2(bytes + block, a, b, in, firsts);
+                        scanned = true;
+                    }
+                }
+#endif
+                if (!scanned) {
+                    for (std::size_t i = 0; i < count; i++) {
+                        in |= std::uint64_t(in_table(bytes[block + i])) << i;
+                        firsts |= std::uint64_t(p[block + i] == a || p[block + i] == b) << i;
+                    }
+                }
+                const std::uint64_t tokens = count == 64 ? in ^ flip : (in ^ flip) & ((std::uint64_t(1) << count) - 1);
+                std::uint64_t starts = tokens & ~((tokens << 1) | carry) & firsts;
+                carry = tokens >> 63;
+                while (starts != 0) {
+                    if (!f(block + lowest_bit(starts))) {
+                        return false;
+                    }
+                    starts &= starts - 1;
+                }
+            }
+            return true;
+        }
+    };
+
+    // a 64 bit bloom filter of the tokens of a line under the default
+    // token class of darcs, A-Za-z_0-9, each token sets two bits
+    //
+    // a TokReplace with the default class leaves a line as it is when
+    // neither its o nor its n can be in the bloom of the line
+    //
+    template <typename char_t>
+    struct TokenBloom {
+        static const TokChars<char_t> & default_chars() {
+            static const TokChars<char_t> chars(std::vector<char_t>({'A', '-', 'Z', 'a', '-', 'z', '_', '0', '-', '9'}));
+            return chars;
+        }
+
+        template <typename I>
+        static std::uint64_t of_token(I begin, const I end) {
+            // FNV-1a
+            std::uint64_t hash = 14695981039346656037ull;
+            for (; begin != end; ++begin) {
+                hash = (hash ^ static_cast<std::uint64_t>(static_cast<typename std::make_unsigned<char_t>::type>(*begin))) * 1099511628211ull;
+            }
+            return (std::uint64_t(1) << (hash & 63)) | (std::uint64_t(1) << ((hash >> 32) & 63));
+        }
+
+        template <typename adapter_t>
+        static std::uint64_t of_line(const adapter_t & line) {
+            const TokChars<char_t> & chars = default_chars();
+            std::uint64_t bloom = 0;
+            std::vector<char_t> token;
+            for (const char_t & c : line) {
+                if (chars(c)) {
+                    token.push_back(c);
+                } else if (token.size() != 0) {
+                    bloom |= of_token(token.begin(), token.end());
+                    token.clear();
+                }
+            }
+            if (token.size() != 0) {
+                bloom |= of_token(token.begin(), token.end());
+            }
+            return bloom;
+        }
+
+        // in the order the lines are iterated
+        template <typename adapter_t>
+        static std::vector<std::uint64_t> of_lines(const RL<adapter_t> & lines) {
+            std::vector<std::uint64_t> blooms;
+            blooms.reserve(lines.size());
+            for (const adapter_t & line : lines) {
+                blooms.push_back(of_line(line));
+            }
+            return blooms;
+        }
+
+        static bool may_have(const std::uint64_t line, const std::uint64_t token) {
+            return (line & token) == token;
+        }
     };
 
     template <
@@ -1941,16 +3060,27 @@ namespace DarcsPatch {
         adapter_t t;
         adapter_t o;
         adapter_t n;
+        // t compiled, shared with the inverse and with copies
+        std::shared_ptr<const TokChars<char_t>> chars;
 
-        TokReplace() = default;
-        TokReplace(const adapter_t & t, const adapter_t & o, const adapter_t & n) : t(t), o(o), n(n) {}
+        static std::shared_ptr<const TokChars<char_t>> compile(const adapter_t & t) {
+            std::vector<char_t> spec;
+            for (const char_t & c : t) {
+                spec.push_back(c);
+            }
+            return std::make_shared<const TokChars<char_t>>(spec);
+        }
+
+        TokReplace() : chars(std::make_shared<const TokChars<char_t>>()) {}
+        TokReplace(const adapter_t & t, const adapter_t & o, const adapter_t & n) : t(t), o(o), n(n), chars(compile(t)) {}
+        TokReplace(const adapter_t & t, const adapter_t & o, const adapter_t & n, const std::shared_ptr<const TokChars<char_t>> & chars) : t(t), o(o), n(n), chars(chars) {}
 
         const PATCH_TYPE type() const override {
             return TOK_REPLACE;
         }
 
         std::shared_ptr<Patch> invert() const override {
-            return std::static_pointer_cast<Patch>(std::make_shared<TokReplace>(t, n, o));
+            return std::static_pointer_cast<Patch>(std::make_shared<TokReplace>(t, n, o, chars));
         }
 
         ::std::ostream & to_stream(::std::ostream & os) const override {
@@ -1981,13 +3111,41 @@ namespace DarcsPatch {
         typename AdapterMustExtendBasicStringAdapter = typename std::enable_if<std::is_base_of<StringAdapter::BasicStringAdapter<char_t>, adapter_t>::value>::type
     >
     struct FileHunk : Patch {
+        // the TokenBloom of each line of both sides of a hunk
+        struct Blooms {
+            std::vector<std::uint64_t> old_lines;
+            std::vector<std::uint64_t> new_lines;
+        };
+
+        private:
+
+        // only a hunk can make another with the blooms of its own lines
+        class SameLines {
+            friend FileHunk;
+            SameLines() {}
+        };
+
+        public:
+
         std::size_t line;
-        RL<adapter_t> old_lines;
-        RL<adapter_t> new_lines;
-        FileHunk() : line(0), old_lines(NilFL), new_lines(NilFL) {}
-        FileHunk(const std::size_t & line, const RL<adapter_t>& old_lines, const RL<adapter_t>& new_lines) : line(line), old_lines(old_lines), new_lines(new_lines) {}
-        FileHunk(const std::size_t & line, const adapter_t& old_line, const adapter_t& new_line) : line(line) {
+        // const, as the blooms are made from them
+        const RL<adapter_t> old_lines;
+        const RL<adapter_t> new_lines;
+
+        private:
+
+        // made the first time they are asked for, and shared with the
+        // hunks moved or inverted from this one. inverted says that the
+        // old and new lines of this hunk are the new and old lines of the
+        // hunk they were made for
+        LazyValue<Blooms> blooms;
+        bool inverted;
 
+        static LazyValue<Blooms> blooms_of(const RL<adapter_t> & old_lines, const RL<adapter_t> & new_lines) {
+            return LazyValue<Blooms>([old_lines, new_lines] { return Blooms{TokenBloom<char_t>::of_lines(old_lines), TokenBloom<char_t>::of_lines(new_lines)}; });
+        }
+
+        static RL<adapter_t> lines_of(const adapter_t & text) {
             // need to cast from
             //       std::shared_ptr<BasicStringAdapter<T>>
             //   to
@@ -1995,14 +3153,33 @@ namespace DarcsPatch {
             //
             // we know lines allocates an instance of adapter_t or higher derived object
             //
-            auto ol = old_line.lines();
-            auto nl = new_line.lines();
-            for (auto & o : ol) {
-                old_lines = old_lines.push(*static_cast<adapter_t*>(o.get()));
-            }
-            for (auto & n : nl) {
-                new_lines = new_lines.push(*static_cast<adapter_t*>(n.get()));
+            auto ls = text.lines();
+            typename RL<adapter_t>::Builder builder;
+            builder.reserve(ls.size());
+            for (auto & l : ls) {
+                builder.push(*static_cast<adapter_t*>(l.get()));
             }
+            return builder.freeze();
+        }
+
+        public:
+
+        FileHunk() : line(0), old_lines(NilFL), new_lines(NilFL), blooms(blooms_of(old_lines, new_lines)), inverted(false) {}
+        FileHunk(const std::size_t & line, const RL<adapter_t>& old_lines, const RL<adapter_t>& new_lines) : line(line), old_lines(old_lines), new_lines(new_lines), blooms(blooms_of(old_lines, new_lines)), inverted(false) {}
+        FileHunk(const std::size_t & line, const adapter_t& old_line, const adapter_t& new_line) : line(line), old_lines(lines_of(old_line)), new_lines(lines_of(new_line)), blooms(blooms_of(old_lines, new_lines)), inverted(false) {}
+        FileHunk(SameLines, const std::size_t & line, const RL<adapter_t>& old_lines, const RL<adapter_t>& new_lines, const LazyValue<Blooms> & blooms, const bool inverted) : line(line), old_lines(old_lines), new_lines(new_lines), blooms(blooms), inverted(inverted) {}
+
+        const std::vector<std::uint64_t> & old_blooms() const {
+            return inverted ? blooms().new_lines : blooms().old_lines;
+        }
+
+        const std::vector<std::uint64_t> & new_blooms() const {
+            return inverted ? blooms().old_lines : blooms().new_lines;
+        }
+
+        // this hunk at another line
+        std::shared_ptr<Patch> at_line(const std::size_t & line) const {
+            return std::static_pointer_cast<Patch>(std::make_shared<FileHunk<char_t, adapter_t>>(SameLines(), line, old_lines, new_lines, blooms, inverted));
         }
 
         const PATCH_TYPE type() const override {
@@ -2010,7 +3187,7 @@ namespace DarcsPatch {
         }
 
         std::shared_ptr<Patch> invert() const override {
-            return std::static_pointer_cast<Patch>(std::make_shared<FileHunk<char_t, adapter_t>>(line, new_lines, old_lines));
+            return std::static_pointer_cast<Patch>(std::make_shared<FileHunk<char_t, adapter_t>>(SameLines(), line, new_lines, old_lines, blooms, !inverted));
         }
 
         ::std::ostream & to_stream(::std::ostream & os) const override {
@@ -2052,17 +3229,22 @@ namespace DarcsPatch {
         typename AdapterMustExtendBasicStringAdapter = typename std::enable_if<std::is_base_of<StringAdapter::BasicStringAdapter<char_t>, adapter_t>::value>::type
     >
     struct PatchInfo :
-        public StringAdapter::Comparable<PatchInfo<char_t, adapter_t>>,
-        public StringAdapter::Hashable<PatchInfo<char_t, adapter_t>>
+        public StaticComparable<PatchInfo<char_t, adapter_t>>,
+        public StaticHashable<PatchInfo<char_t, adapter_t>>
     {
         using THIS = PatchInfo<char_t, adapter_t>;
-        COMPARABLE_USING_BASE(StringAdapter::Comparable<THIS>);
-        HASHABLE_USING_BASE(StringAdapter::Hashable<THIS>);
+        STATIC_COMPARABLE_USING_BASE(StaticComparable<THIS>);
+        STATIC_HASHABLE_USING_BASE(StaticHashable<THIS>);
 
-        PatchInfo() :
-            THIS::Comparable([](auto & a, auto & b) { return StringAdapter::compare_3(a, b, &THIS::date, &THIS::name, &THIS::author, &THIS::log, &THIS::legacyIsInverted); }),
-            THIS::Hashable([](auto & a) { return StringAdapter::hash_3(a, &THIS::date, &THIS::name, &THIS::author, &THIS::log, &THIS::legacyIsInverted); })
-        {}
+        static int compare(const THIS & a, const THIS & b) {
+            return StringAdapter::compare_3(a, b, &THIS::date, &THIS::name, &THIS::author, &THIS::log, &THIS::legacyIsInverted);
+        }
+
+        static std::size_t hash(const THIS & a) {
+            return StringAdapter::hash_3(a, &THIS::date, &THIS::name, &THIS::author, &THIS::log, &THIS::legacyIsInverted);
+        }
+
+        PatchInfo() {}
 
         uint64_t additional_data = 0;
 
@@ -2073,15 +3255,11 @@ namespace DarcsPatch {
         bool legacyIsInverted = false;
 
         PatchInfo(const adapter_t & name) :
-            THIS::Comparable([](auto & a, auto & b) { return StringAdapter::compare_3(a, b, &THIS::date, &THIS::name, &THIS::author, &THIS::log, &THIS::legacyIsInverted); }),
-            THIS::Hashable([](auto & a) { return StringAdapter::hash_3(a, &THIS::date, &THIS::name, &THIS::author, &THIS::log, &THIS::legacyIsInverted); }),
             name(name)
         {
         }
 
         PatchInfo(const adapter_t & date, const adapter_t & name, const adapter_t & author, const RL<adapter_t> & log) :
-            THIS::Comparable([](auto & a, auto & b) { return StringAdapter::compare_3(a, b, &THIS::date, &THIS::name, &THIS::author, &THIS::log, &THIS::legacyIsInverted); }),
-            THIS::Hashable([](auto & a) { return StringAdapter::hash_3(a, &THIS::date, &THIS::name, &THIS::author, &THIS::log, &THIS::legacyIsInverted); }),
             date(date),
             name(name),
             author(author),
@@ -2090,16 +3268,12 @@ namespace DarcsPatch {
         }
 
         PatchInfo(uint64_t additional_data, const adapter_t & name) :
-            THIS::Comparable([](auto & a, auto & b) { return StringAdapter::compare_3(a, b, &THIS::date, &THIS::name, &THIS::author, &THIS::log, &THIS::legacyIsInverted); }),
-            THIS::Hashable([](auto & a) { return StringAdapter::hash_3(a, &THIS::date, &THIS::name, &THIS::author, &THIS::log, &THIS::legacyIsInverted); }),
             additional_data(additional_data),
             name(name)
         {
         }
 
         PatchInfo(uint64_t additional_data, const adapter_t & date, const adapter_t & name, const adapter_t & author, const RL<adapter_t> & log) :
-            THIS::Comparable([](auto & a, auto & b) { return StringAdapter::compare_3(a, b, &THIS::date, &THIS::name, &THIS::author, &THIS::log, &THIS::legacyIsInverted); }),
-            THIS::Hashable([](auto & a) { return StringAdapter::hash_3(a, &THIS::date, &THIS::name, &THIS::author, &THIS::log, &THIS::legacyIsInverted); }),
             additional_data(additional_data),
             date(date),
             name(name),
@@ -2142,15 +3316,97 @@ namespace DarcsPatch {
 
 namespace DarcsPatch {
 
+    // every path a program has made an AnchorPath of, each with a 32 bit id
+    //
+    // paths are only ever added, and the names of a path never move once
+    // added, so an AnchorPath can keep a pointer to them and read them
+    // without taking the lock. the empty path is id 0.
+    //
+    template <
+        typename char_t,
+        typename adapter_t,
+        typename AdapterMustExtendBasicStringAdapter = typename std::enable_if<std::is_base_of<StringAdapter::BasicStringAdapter<char_t>, adapter_t>::value>::type
+    >
+    class AnchorPathTable {
+        public:
+
+        struct Entry {
+            std::uint32_t id;
+            Set<adapter_t> names;
+            std::size_t hash;
+        };
+
+        private:
+
+        std::mutex mutex;
+        std::unordered_map<Set<adapter_t>, const Entry *> ids;
+        // a deque keeps its items where they are as it grows
+        std::deque<Entry> entries;
+        const Entry * empty_;
+
+        AnchorPathTable() {
+            empty_ = intern(Set<adapter_t>());
+        }
+
+        public:
+
+        AnchorPathTable(const AnchorPathTable &) = delete;
+        AnchorPathTable & operator =(const AnchorPathTable &) = delete;
+
+        static AnchorPathTable & global() {
+            static AnchorPathTable table;
+            return table;
+        }
+
+        const Entry * empty() const {
+            return empty_;
+        }
+
+        const Entry * intern(const Set<adapter_t> & names) {
+            std::lock_guard<std::mutex> lock(mutex);
+            auto found = ids.find(names);
+            if (found != ids.end()) {
+                return found->second;
+            }
+            if (entries.size() > std::numeric_limits<std::uint32_t>::max()) {
+                throw std::runtime_error("too many paths to give each a 32 bit id");
+            }
+            entries.push_back(Entry{static_cast<std::uint32_t>(entries.size()), names, std::hash<Set<adapter_t>>()(names)});
+            const Entry * entry = &entries.back();
+            ids.emplace(names, entry);
+            return entry;
+        }
+
+        std::size_t size() {
+            std::lock_guard<std::mutex> lock(mutex);
+            return entries.size();
+        }
+    };
+
+    // a path as the id AnchorPathTable::global() gives its names, two
+    // paths are equal when their ids are
+    //
+    // the names are only read to print a path and to order two paths
+    // that differ, paths are ordered by their names as they always were
+    //
     template <
         typename char_t,
         typename adapter_t,
         typename AdapterMustExtendBasicStringAdapter = typename std::enable_if<std::is_base_of<StringAdapter::BasicStringAdapter<char_t>, adapter_t>::value>::type
     >
     struct AnchorPath {
-        Set<adapter_t> names;
-        AnchorPath() : names({}) {}
-        AnchorPath(const Set<adapter_t> & names) : names(names) {}
+        using Table = AnchorPathTable<char_t, adapter_t>;
+
+        std::uint32_t id;
+        const typename Table::Entry * entry;
+
+        AnchorPath() : AnchorPath(Table::global().empty()) {}
+        AnchorPath(const Set<adapter_t> & names) : AnchorPath(Table::global().intern(names)) {}
+        AnchorPath(const typename Table::Entry * entry) : id(entry->id), entry(entry) {}
+
+        const Set<adapter_t> & names() const {
+            return entry->names;
+        }
 
         void to_string() const {
             std::cout << *this;
@@ -2161,33 +3417,33 @@ namespace DarcsPatch {
         }
 
         bool operator == (const AnchorPath<char_t, adapter_t> & other) const {
-            return names == other.names;
+            return id == other.id;
         }
 
         bool operator != (const AnchorPath<char_t, adapter_t> & other) const {
-            return names != other.names;
+            return id != other.id;
         }
 
         bool operator < (const AnchorPath<char_t, adapter_t> & other) const {
-            return names < other.names;
+            return id != other.id && names() < other.names();
         }
 
         bool operator > (const AnchorPath<char_t, adapter_t> & other) const {
-            return names > other.names;
+            return id != other.id && names() > other.names();
         }
 
         bool operator <= (const AnchorPath<char_t, adapter_t> & other) const {
-            return names <= other.names;
+            return id == other.id || names() <= other.names();
         }
 
         bool operator >= (const AnchorPath<char_t, adapter_t> & other) const {
-            return names >= other.names;
+            return id == other.id || names() >= other.names();
         }
 
         std::size_t hashCode() const noexcept {
             // https://docs.oracle.com/javase/8/docs/api/java/util/List.html#hashCode--
             std::size_t hashCode_ = 1;
-            hashCode_ = 31 * hashCode_ + std::hash<Set<adapter_t>>()(names);
+            hashCode_ = 31 * hashCode_ + entry->hash;
             return hashCode_;
         }
     };
@@ -2200,7 +3456,7 @@ namespace DarcsPatch {
         typename AdapterMustExtendBasicStringAdapter = typename std::enable_if<std::is_base_of<StringAdapter::BasicStringAdapter<char_t>, adapter_t>::value>::type
     >
     ::std::ostream& operator <<(::std::ostream& os, const DarcsPatch::AnchorPath<char_t, adapter_t> & item) {
-        os << "{ AnchorPath, names = " << item.names << " }";
+        os << "{ AnchorPath, names = " << item.names() << " }";
         return os;
     }
 }
@@ -2213,17 +3469,22 @@ namespace DarcsPatch {
         typename AdapterMustExtendBasicStringAdapter = typename std::enable_if<std::is_base_of<StringAdapter::BasicStringAdapter<char_t>, adapter_t>::value>::type
     >
     struct Core_FP :
-        public StringAdapter::Comparable<Core_FP<char_t, adapter_t>>,
-        public StringAdapter::Hashable<Core_FP<char_t, adapter_t>>
+        public StaticComparable<Core_FP<char_t, adapter_t>>,
+        public StaticHashable<Core_FP<char_t, adapter_t>>
     {
         using THIS = Core_FP<char_t, adapter_t>;
-        COMPARABLE_USING_BASE(StringAdapter::Comparable<THIS>);
-        HASHABLE_USING_BASE(StringAdapter::Hashable<THIS>);
+        STATIC_COMPARABLE_USING_BASE(StaticComparable<THIS>);
+        STATIC_HASHABLE_USING_BASE(StaticHashable<THIS>);
 
-        Core_FP() :
-            THIS::Comparable([](auto & a, auto & b) { return StringAdapter::compare_3(a, b, &THIS::anchor_path, &THIS::patch); }),
-            THIS::Hashable([](auto & a) { return StringAdapter::hash_3(a, &THIS::anchor_path, &THIS::patch); })
-        {}
+        static int compare(const THIS & a, const THIS & b) {
+            return StringAdapter::compare_3(a, b, &THIS::anchor_path, &THIS::patch);
+        }
+
+        static std::size_t hash(const THIS & a) {
+            return StringAdapter::hash_3(a, &THIS::anchor_path, &THIS::patch);
+        }
+
+        Core_FP() {}
 
         AnchorPath<char_t, adapter_t> anchor_path;
         std::shared_ptr<Patch> patch;
@@ -2258,6 +3519,77 @@ namespace DarcsPatch {
     }
 }
 
+namespace DarcsPatch {
+
+    // the files a list of prims touches, sorted by path, and the lines its
+    // hunks cover in each of them
+    template <
+        typename char_t,
+        typename adapter_t,
+        typename AdapterMustExtendBasicStringAdapter = typename std::enable_if<std::is_base_of<StringAdapter::BasicStringAdapter<char_t>, adapter_t>::value>::type
+    >
+    struct TouchSummary {
+        struct File {
+            AnchorPath<char_t, adapter_t> path;
+            std::size_t prims = 0;
+            bool hunks_only = true;
+            // the hunk, when it is the only prim on the file
+            std::size_t line = 0;
+            std::size_t old_lines = 0;
+            std::size_t new_lines = 0;
+
+            bool lone_hunk() const {
+                return prims == 1 && hunks_only;
+            }
+        };
+
+        std::vector<File> files;
+
+        bool touches_any_of(const TouchSummary & other) const {
+            for (std::size_t i = 0, j = 0; i < files.size() && j < other.files.size();) {
+                if (files[i].path < other.files[j].path) i++;
+                else if (other.files[j].path < files[i].path) j++;
+                else return true;
+            }
+            return false;
+        }
+    };
+
+    // only lists of Core_FP have a summary
+    template <typename char_t, typename adapter_t, typename T>
+    std::shared_ptr<const TouchSummary<char_t, adapter_t>> touchSummaryOf(const FL<T> & p) {
+        return nullptr;
+    }
+
+    template <
+        typename char_t,
+        typename adapter_t,
+        typename AdapterMustExtendBasicStringAdapter = typename std::enable_if<std::is_base_of<StringAdapter::BasicStringAdapter<char_t>, adapter_t>::value>::type
+    >
+    std::shared_ptr<const TouchSummary<char_t, adapter_t>> touchSummaryOf(const FL<Core_FP<char_t, adapter_t>> & p) {
+        using FILE = typename TouchSummary<char_t, adapter_t>::File;
+        auto summary = std::make_shared<TouchSummary<char_t, adapter_t>>();
+        auto & files = summary->files;
+        for (const auto & prim : p) {
+            auto file = std::lower_bound(files.begin(), files.end(), prim.anchor_path, [](const FILE & a, const AnchorPath<char_t, adapter_t> & b) { return a.path < b; });
+            if (file == files.end() || file->path != prim.anchor_path) {
+                file = files.insert(file, FILE());
+                file->path = prim.anchor_path;
+            }
+            file->prims++;
+            if (prim.patch->type() == HUNK && file->hunks_only) {
+                auto * hunk = static_cast<const FileHunk<char_t, adapter_t> *>(prim.patch.get());
+                file->line = hunk->line;
+                file->old_lines = hunk->old_lines.size();
+                file->new_lines = hunk->new_lines.size();
+            } else {
+                file->hunks_only = false;
+            }
+        }
+        return summary;
+    }
+}
+
 namespace DarcsPatch {
 
     template <
@@ -2267,26 +3599,67 @@ namespace DarcsPatch {
         typename AdapterMustExtendBasicStringAdapter = typename std::enable_if<std::is_base_of<StringAdapter::BasicStringAdapter<char_t>, adapter_t>::value>::type
     >
     struct Named :
-        public StringAdapter::Comparable<Named<T, char_t, adapter_t>>,
-        public StringAdapter::Hashable<Named<T, char_t, adapter_t>>
+        public StaticComparable<Named<T, char_t, adapter_t>>,
+        public StaticHashable<Named<T, char_t, adapter_t>>
     {
         using THIS = Named<T, char_t, adapter_t>;
-        COMPARABLE_USING_BASE(StringAdapter::Comparable<THIS>);
-        HASHABLE_USING_BASE(StringAdapter::Hashable<THIS>);
+        STATIC_COMPARABLE_USING_BASE(StaticComparable<THIS>);
+        STATIC_HASHABLE_USING_BASE(StaticHashable<THIS>);
 
-        Named() :
-            THIS::Comparable([](auto & a, auto & b) { return StringAdapter::compare_3(a, b, &THIS::n, &THIS::d, &THIS::p); }),
-            THIS::Hashable([](auto & a) { return StringAdapter::hash_3(a, &THIS::n, &THIS::d, &THIS::p); })
-        {}
+        static int compare(const THIS & a, const THIS & b) {
+            return StringAdapter::compare_3(a, b, &THIS::n, &THIS::d, &THIS::p);
+        }
+
+        static std::size_t hash(const THIS & a) {
+            return StringAdapter::hash_3(a, &THIS::n, &THIS::d, &THIS::p);
+        }
+
+        Named() {}
 
         PatchInfo<char_t, adapter_t> n;
         Set<PatchInfo<char_t, adapter_t>> d;
         FL<T> p;
+
+        private:
+
+        // the TouchSummary of p when T is Core_FP, made by the constructor
+        // and shared by every copy, it is not part of the value
+        //
+        // it is only ever made from p, or carried over to a patch with the
+        // same prims in another order, so p must not be assigned once the
+        // patch is made, make a new Named instead
+        //
+        std::shared_ptr<const TouchSummary<char_t, adapter_t>> summary;
+
+        public:
         
         Named(const PatchInfo<char_t, adapter_t> & n, const Set<PatchInfo<char_t, adapter_t>> & d, const FL<T> & p) : Named() {
             this->n = n;
             this->d = d;
             this->p = p;
+            summary = touchSummaryOf<char_t, adapter_t>(p);
+        }
+
+        // the files and lines p touches, made from p when the patch was
+        // not given it on construction
+        std::shared_ptr<const TouchSummary<char_t, adapter_t>> touched() const {
+            return summary ? summary : touchSummaryOf<char_t, adapter_t>(p);
+        }
+
+        // this patch with its prims in reverse order, which touch the same
+        // lines so the summary is shared
+        Named reversed() const {
+            typename FL<T>::Builder builder;
+            builder.reserve(p.size());
+            for (const T & prim : p) {
+                builder.push(prim);
+            }
+            Named result;
+            result.n = n;
+            result.d = d;
+            result.p = builder.freeze();
+            result.summary = summary;
+            return result;
         }
 
         PatchInfo<char_t, adapter_t> ident() {
@@ -2438,12 +3811,273 @@ namespace DarcsPatch {
     Named_T<Core_FP_T> makeNamedHunk_T(const StringAdapter::CharAdapter & patch_id_unique_label, const std::size_t & line, const StringAdapter::CharAdapter & old_line, const StringAdapter::CharAdapter & new_line);
     Named_T<Core_FP_T> makeNamedHunk_T(uint64_t additional_data, const StringAdapter::CharAdapter & patch_id_unique_label, const std::size_t & line, const StringAdapter::CharAdapter & old_line, const StringAdapter::CharAdapter & new_line);
 
+    // dense ids for the patches of one DepsGraph
+    //
+    // depsGraph numbers its patches in PatchInfo order, so iterating a
+    // PatchSet built on that index visits its patches in the same order a
+    // Set<PatchInfo> would.
+    //
+    // an index can extend a base index, keeping every id of the base and
+    // numbering its own patches after them, so sets on the base are valid
+    // sets on the extension without being renumbered.
+    template <
+        typename char_t,
+        typename adapter_t,
+        typename AdapterMustExtendBasicStringAdapter = typename std::enable_if<std::is_base_of<StringAdapter::BasicStringAdapter<char_t>, adapter_t>::value>::type
+    >
+    struct PatchIndex {
+        static constexpr uint32_t NOT_FOUND = ~uint32_t(0);
+
+        std::shared_ptr<const PatchIndex> base;
+        uint32_t offset = 0;
+        std::size_t depth = 0;
+        std::vector<PatchInfo<char_t, adapter_t>> infos;
+        std::unordered_map<PatchInfo<char_t, adapter_t>, uint32_t> ids;
+
+        PatchIndex() {}
+
+        PatchIndex(const std::shared_ptr<const PatchIndex> & base) :
+            base(base), offset(base->size()), depth(base->depth + 1)
+        {}
+
+        // returns the id of info, giving it the next free id if it has none
+        uint32_t add(const PatchInfo<char_t, adapter_t> & info) {
+            if (base) {
+                const uint32_t id = base->id_of(info);
+                if (id != NOT_FOUND) {
+                    return id;
+                }
+            }
+            auto search = ids.find(info);
+            if (search != ids.end()) {
+                return search->second;
+            }
+            const uint32_t id = size();
+            infos.push_back(info);
+            ids.emplace(info, id);
+            return id;
+        }
+
+        uint32_t id_of(const PatchInfo<char_t, adapter_t> & info) const {
+            for (const PatchIndex * index = this; index != nullptr; index = index->base.get()) {
+                auto search = index->ids.find(info);
+                if (search != index->ids.end()) {
+                    return search->second;
+                }
+            }
+            return NOT_FOUND;
+        }
+
+        const PatchInfo<char_t, adapter_t> & operator[] (const uint32_t id) const {
+            const PatchIndex * index = this;
+            while (id < index->offset) {
+                index = index->base.get();
+            }
+            return index->infos[id - index->offset];
+        }
+
+        const std::size_t size() const {
+            return offset + infos.size();
+        }
+
+        // true if this is other or extends it
+        const bool extends(const PatchIndex & other) const {
+            for (const PatchIndex * index = this; index != nullptr; index = index->base.get()) {
+                if (index == &other) {
+                    return true;
+                }
+            }
+            return false;
+        }
+    };
+
+    // a set of PatchInfo stored as a CompressedBitset of PatchIndex ids
+    //
+    // sets that are combined must share an index or be on an index the
+    // other one extends, a set without one is empty and takes the index of
+    // the first set it is combined with.
+    template <
+        typename char_t,
+        typename adapter_t,
+        typename AdapterMustExtendBasicStringAdapter = typename std::enable_if<std::is_base_of<StringAdapter::BasicStringAdapter<char_t>, adapter_t>::value>::type
+    >
+    struct PatchSet :
+        public StaticComparable<PatchSet<char_t, adapter_t>>,
+        public StaticHashable<PatchSet<char_t, adapter_t>>
+    {
+        using THIS = PatchSet<char_t, adapter_t>;
+        using INDEX = PatchIndex<char_t, adapter_t>;
+        STATIC_COMPARABLE_USING_BASE(StaticComparable<THIS>);
+        STATIC_HASHABLE_USING_BASE(StaticHashable<THIS>);
+
+        static int compare(const THIS & a, const THIS & b) {
+            return StringAdapter::compare_3_iterator(a, b, &THIS::cbegin, &THIS::cend);
+        }
+
+        static std::size_t hash(const THIS & a) {
+            return StringAdapter::hash_3_iterator<THIS, PatchInfo<char_t, adapter_t>>(a);
+        }
+
+        std::shared_ptr<const INDEX> index;
+        CompressedBitset ids;
+
+        PatchSet() {}
+        PatchSet(const std::shared_ptr<const INDEX> & index) : index(index) {}
+
+        void to_string() const {
+            std::cout << *this;
+        }
+
+        void to_string() {
+            std::cout << *this;
+        }
+
+        class const_iterator {
+            const INDEX * index = nullptr;
+            CompressedBitset::const_iterator it;
+
+            public:
+
+            using iterator_category = std::forward_iterator_tag;
+            using value_type = PatchInfo<char_t, adapter_t>;
+            using difference_type = std::ptrdiff_t;
+            using pointer = const value_type *;
+            using reference = const value_type &;
+
+            const_iterator() = default;
+            const_iterator(const INDEX * index, const CompressedBitset::const_iterator & it) : index(index), it(it) {}
+
+            reference operator*() const {
+                return (*index)[*it];
+            }
+
+            pointer operator->() const {
+                return &(*index)[*it];
+            }
+
+            const_iterator & operator++() {
+                ++it;
+                return *this;
+            }
+
+            const_iterator operator++(int) {
+                const_iterator copy = *this;
+                ++it;
+                return copy;
+            }
+
+            bool operator == (const const_iterator & other) const {
+                return it == other.it;
+            }
+
+            bool operator != (const const_iterator & other) const {
+                return it != other.it;
+            }
+        };
+
+        using iterator = const_iterator;
+
+        const_iterator cbegin() const {
+            return const_iterator(index.get(), ids.begin());
+        }
+
+        const_iterator cend() const {
+            return const_iterator(index.get(), ids.end());
+        }
+
+        const_iterator begin() const {
+            return cbegin();
+        }
+
+        const_iterator end() const {
+            return cend();
+        }
+
+        const std::size_t size() const {
+            return ids.size();
+        }
+
+        const bool contains_id(const uint32_t id) const {
+            return ids.contains(id);
+        }
+
+        const bool contains(const PatchInfo<char_t, adapter_t> & item) const {
+            if (!index) {
+                return false;
+            }
+            const uint32_t id = index->id_of(item);
+            return id != INDEX::NOT_FOUND && ids.contains(id);
+        }
+
+        THIS & insert_in_place(const PatchInfo<char_t, adapter_t> & item) {
+            const uint32_t id = index ? index->id_of(item) : INDEX::NOT_FOUND;
+            if (id == INDEX::NOT_FOUND) {
+                throw std::runtime_error("PATCH IS NOT IN THE INDEX");
+            }
+            ids.insert(id);
+            return *this;
+        }
+
+        const THIS insert(const PatchInfo<char_t, adapter_t> & item) const {
+            THIS copy = *this;
+            copy.insert_in_place(item);
+            return copy;
+        }
+
+        // the same patches numbered by another index that has all of them
+        const THIS renumbered(const std::shared_ptr<const INDEX> & other) const {
+            THIS s(other);
+            for (const auto & info : *this) {
+                s.insert_in_place(info);
+            }
+            return s;
+        }
+
+        const THIS Union(const THIS & other) const {
+            // the result takes whichever index extends the other
+            std::shared_ptr<const INDEX> wider = index ? index : other.index;
+            if (index && other.index && index != other.index) {
+                if (other.index->extends(*index)) {
+                    wider = other.index;
+                } else if (!index->extends(*other.index)) {
+                    throw std::runtime_error("PATCH SETS HAVE DIFFERENT INDEXES");
+                }
+            }
+            THIS s(wider);
+            s.ids = CompressedBitset::Union(ids, other.ids);
+            return s;
+        }
+    };
+
+    template <typename char_t, typename adapter_t>
+    ::std::ostream& operator <<(::std::ostream& os, const DarcsPatch::PatchSet<char_t, adapter_t> & item) {
+        auto b = item.begin();
+        auto e = item.end();
+        if (b == e) {
+            return os << "[]";
+        }
+        os << "[ ";
+        for (; b != e; ++b) {
+            os << *b;
+            if (std::next(b) != e) {
+                os << ", ";
+            } else {
+                os << " ";
+            }
+        }
+        os << "]";
+        return os;
+    }
+
+    using PatchIndex_T = PatchIndex<char, StringAdapter::CharAdapter>;
+    using PatchSet_T = PatchSet<char, StringAdapter::CharAdapter>;
+
     template <
         typename char_t,
         typename adapter_t,
         typename AdapterMustExtendBasicStringAdapter = typename std::enable_if<std::is_base_of<StringAdapter::BasicStringAdapter<char_t>, adapter_t>::value>::type
     >
-    using Deps = Tuple2<Set<PatchInfo<char_t, adapter_t>>, Set<PatchInfo<char_t, adapter_t>>>;
+    using Deps = Tuple2<PatchSet<char_t, adapter_t>, PatchSet<char_t, adapter_t>>;
 
     using Deps_T = Deps<char, StringAdapter::CharAdapter>;
 
@@ -2650,9 +4284,10 @@ STRING_ADAPTER_HASHCODE_SPEC_T(INDEXED_ITERATOR_EMBED_COMMAS(typename T1, typena
 STRING_ADAPTER_HASHCODE_SPEC_T(INDEXED_ITERATOR_EMBED_COMMAS(typename T), INDEXED_ITERATOR_EMBED_COMMAS(DarcsPatch::FL<T>));
 STRING_ADAPTER_HASHCODE_SPEC_T(INDEXED_ITERATOR_EMBED_COMMAS(typename T), INDEXED_ITERATOR_EMBED_COMMAS(DarcsPatch::RL<T>));
 STRING_ADAPTER_HASHCODE_SPEC_T(INDEXED_ITERATOR_EMBED_COMMAS(typename T), INDEXED_ITERATOR_EMBED_COMMAS(DarcsPatch::Maybe<T>));
-STRING_ADAPTER_HASHCODE_SPEC_T(INDEXED_ITERATOR_EMBED_COMMAS(typename T), INDEXED_ITERATOR_EMBED_COMMAS(DarcsPatch::Set<T>));
+STRING_ADAPTER_HASHCODE_SPEC_T(INDEXED_ITERATOR_EMBED_COMMAS(typename T, typename SET_T), INDEXED_ITERATOR_EMBED_COMMAS(DarcsPatch::Set<T, SET_T>));
 STRING_ADAPTER_HASHCODE_SPEC_T(INDEXED_ITERATOR_EMBED_COMMAS(typename T1, typename T2), INDEXED_ITERATOR_EMBED_COMMAS(DarcsPatch::Map<T1, T2>));
 STRING_ADAPTER_HASHCODE_SPEC_T(INDEXED_ITERATOR_EMBED_COMMAS(typename T1, typename T2), INDEXED_ITERATOR_EMBED_COMMAS(DarcsPatch::PatchInfo<T1, T2>));
+STRING_ADAPTER_HASHCODE_SPEC_T(INDEXED_ITERATOR_EMBED_COMMAS(typename T1, typename T2), INDEXED_ITERATOR_EMBED_COMMAS(DarcsPatch::PatchSet<T1, T2>));
 STRING_ADAPTER_HASHCODE_SPEC_T(INDEXED_ITERATOR_EMBED_COMMAS(typename T1, typename T2), INDEXED_ITERATOR_EMBED_COMMAS(DarcsPatch::AnchorPath<T1, T2>));
 STRING_ADAPTER_HASHCODE_SPEC_T(INDEXED_ITERATOR_EMBED_COMMAS(typename T1, typename T2), INDEXED_ITERATOR_EMBED_COMMAS(DarcsPatch::Core_FP<T1, T2>));
 STRING_ADAPTER_HASHCODE_SPEC_T(INDEXED_ITERATOR_EMBED_COMMAS(typename T1, typename T2, typename T3), INDEXED_ITERATOR_EMBED_COMMAS(DarcsPatch::Named<T1, T2, T3>));
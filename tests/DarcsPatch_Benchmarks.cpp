@@ -0,0 +1,227 @@
+#include <darcs_patch.h>
+
+#include <chrono>
+#include <cstdio>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+// each benchmark doubles its input size a few times and reports the time
+// per element, an O(n) walk stays flat while an O(n^2) walk doubles per row
+
+using Clock = std::chrono::steady_clock;
+
+template <typename F>
+static double time_ns(F && f) {
+    auto start = Clock::now();
+    f();
+    return std::chrono::duration<double, std::nano>(Clock::now() - start).count();
+}
+
+template <typename LIST>
+static void walk(const char * name) {
+    std::printf("%s\n", name);
+    for (std::size_t n = 4096; n <= 65536; n *= 2) {
+        LIST list;
+        for (std::size_t i = 0; i < n; i++) list = list.push((int) i);
+        volatile long sum = 0;
+        double iterate = time_ns([&] {
+            for (const int & item : list) sum += item;
+        });
+        double index = time_ns([&] {
+            for (std::size_t i = 0; i < n; i++) sum += list[i];
+        });
+        std::printf("  n = %6zu    iterate %8.2f ns/item    operator[] %8.2f ns/item\n", n, iterate / n, index / n);
+    }
+}
+
+// pushes onto a version that is no longer the tip of its base, as the
+// commute loops do after every extract
+template <typename LIST>
+static void push_after_extract(const char * name) {
+    std::printf("%s\n", name);
+    for (std::size_t n = 4096; n <= 65536; n *= 2) {
+        LIST list;
+        for (std::size_t i = 0; i < n; i++) list = list.push((int) i);
+        double push = time_ns([&] {
+            for (std::size_t i = 0; i < n; i++) {
+                int item;
+                LIST rest;
+                list.extract(item, rest);
+                list = rest.push(item + 1);
+            }
+        });
+        std::printf("  n = %6zu    extract + push %8.2f ns/item\n", n, push / n);
+    }
+}
+
+// concatenates a list with itself, the per push cost should stay flat while
+// the list doubles in size
+template <typename LIST>
+static void push_list(const char * name) {
+    std::printf("%s\n", name);
+    LIST list;
+    for (std::size_t i = 0; i < 4096; i++) list = list.push((int) i);
+    for (int round = 0; round < 5; round++) {
+        const std::size_t n = list.size();
+        LIST result;
+        double push = time_ns([&] {
+            for (int i = 0; i < 1000; i++) result = list.push(list);
+        });
+        std::printf("  n = %6zu    push(list) %8.2f ns/push\n", n, push / 1000);
+        list = result;
+    }
+}
+
+// builds, copies and walks many short stores, this is what picked the
+// default number of inline items
+template <std::size_t INLINE_ITEMS>
+static void small_lists() {
+    std::printf("ChunkedStore<int, 5, %zu>\n", INLINE_ITEMS);
+    const std::size_t count = 100000;
+    for (std::size_t n = 1; n <= 4; n++) {
+        std::vector<DarcsPatch::ChunkedStore<int, 5, INLINE_ITEMS>> stores(count);
+        volatile long sum = 0;
+        double build = time_ns([&] {
+            for (auto & store : stores) {
+                for (std::size_t i = 0; i < n; i++) store.emplace_back((int) i);
+            }
+        });
+        double copy = time_ns([&] {
+            auto copies = stores;
+            sum += copies[0].size();
+        });
+        double walk = time_ns([&] {
+            for (const auto & store : stores) {
+                for (std::size_t i = 0; i < store.size(); i++) sum += store[i];
+            }
+        });
+        std::printf("  n = %zu    build %8.2f ns/list    copy %8.2f ns/list    walk %8.2f ns/list\n", n, build / count, copy / count, walk / count);
+    }
+}
+
+// one contains() per item, as foldDeps does once per patch
+template <typename SET>
+static void set_contains(const char * name) {
+    std::printf("%s\n", name);
+    for (std::size_t n = 4096; n <= 65536; n *= 2) {
+        SET set;
+        for (std::size_t i = 0; i < n; i++) set.insert_in_place((int) (i * 2));
+        volatile long found = 0;
+        double contains = time_ns([&] {
+            for (std::size_t i = 0; i < n; i++) found += set.contains((int) i);
+        });
+        std::printf("  n = %6zu    contains %8.2f ns/lookup\n", n, contains / n);
+    }
+}
+
+// keeps every version alive, as callers holding on to older graphs do
+static void map_insert(const char * name) {
+    std::printf("%s\n", name);
+    for (std::size_t n = 4096; n <= 65536; n *= 2) {
+        std::vector<DarcsPatch::Map<int, int>> versions;
+        versions.reserve(n + 1);
+        versions.emplace_back();
+        double insert = time_ns([&] {
+            for (std::size_t i = 0; i < n; i++) versions.push_back(versions.back().insert((int) i, (int) i));
+        });
+        std::printf("  n = %6zu    insert %8.2f ns/insert\n", n, insert / n);
+    }
+}
+
+// hunks at random lines, most of them commute so every patch is folded over
+// most of the ones before it
+static void deps_graph(const char * name) {
+    std::printf("%s\n", name);
+    const std::size_t n = 1000;
+    std::mt19937 rng(1);
+    DarcsPatch::RL<DarcsPatch::Named_T<DarcsPatch::Core_FP_T>> ps;
+    ps = ps.push(DarcsPatch::makeNamedWithType_T("add", DarcsPatch::makeAddFile()));
+    for (std::size_t i = 0; i < n; i++) {
+        ps = ps.push(DarcsPatch::makeNamedHunk_T(("patch " + std::to_string(i)).c_str(), 1 + rng() % (4 * n), "", "line"));
+    }
+    std::size_t most = std::max(1u, std::thread::hardware_concurrency());
+    for (std::size_t threads = 1; threads <= most; threads *= 2) {
+        double build = time_ns([&] {
+            DarcsPatch::depsGraph_T(ps, DarcsPatch::ParallelOptions{threads});
+        });
+        std::printf("  n = %6zu    threads %3zu    %8.2f ms\n", n, threads, build / 1e6);
+    }
+}
+
+// hunks spread over many files, each patch only has to be commuted with
+// the earlier ones on its own file, and each file is a shard of its own
+static void deps_graph_files(const char * name) {
+    std::printf("%s\n", name);
+    std::mt19937 rng(2);
+    std::size_t most = std::max(1u, std::thread::hardware_concurrency());
+    for (std::size_t n = 1000; n <= 8000; n *= 2) {
+        DarcsPatch::RL<DarcsPatch::Named_T<DarcsPatch::Core_FP_T>> ps;
+        for (std::size_t i = 0; i < n; i++) {
+            auto file = DarcsPatch::Set<StringAdapter::CharAdapter>().insert(("file " + std::to_string(rng() % 64)).c_str());
+            DarcsPatch::FL<DarcsPatch::Core_FP_T> hunk = {DarcsPatch::Core_FP_T(DarcsPatch::AnchorPath_T(file), DarcsPatch::makeHunk_T(1 + rng() % 40, "", "line"))};
+            ps = ps.push(DarcsPatch::Named_T<DarcsPatch::Core_FP_T>(DarcsPatch::makePatchInfo_T(("patch " + std::to_string(i)).c_str()), {}, hunk));
+        }
+        double build = time_ns([&] {
+            DarcsPatch::depsGraph_T(ps);
+        });
+        double parallel = time_ns([&] {
+            DarcsPatch::depsGraph_T(ps, DarcsPatch::ParallelOptions{most});
+        });
+        std::printf("  n = %6zu    %8.2f us/patch    threads %3zu    %8.2f us/patch\n", n, build / n / 1e3, most, parallel / n / 1e3);
+    }
+}
+
+// 10 MB of hunk text cut into lines of different lengths, the time per
+// byte should not depend on how long the lines are
+static void tok_replace(const char * name) {
+    std::printf("%s\n", name);
+    const std::size_t total = 10 * 1024 * 1024;
+    const std::string words[] = {"foo ", "food ", "x = foo(y); ", "bar_foo "};
+    std::mt19937 rng(3);
+    for (std::size_t length : {std::size_t(64), std::size_t(4096), std::size_t(262144), total}) {
+        DarcsPatch::RL<StringAdapter::CharAdapter>::Builder lines;
+        for (std::size_t size = 0; size < total;) {
+            std::string line;
+            while (line.size() < length) line += words[rng() % 4];
+            size += line.size();
+            lines.push(StringAdapter::CharAdapter(line));
+        }
+        auto hunk = lines.freeze();
+        auto chars = DarcsPatch::TokReplace<char, StringAdapter::CharAdapter>::compile("A-Za-z_0-9");
+        bool replaced = false;
+        double replace = time_ns([&] {
+            replaced = DarcsPatch::Commute::tryTokReplaces<char, StringAdapter::CharAdapter>(*chars, "foo", "baz", hunk).has_value;
+        });
+        // the same lines as both sides of a hunk
+        double both = time_ns([&] {
+            replaced = replaced && DarcsPatch::Commute::tryTokReplacesHunk<char, StringAdapter::CharAdapter>(*chars, "foo", "baz", hunk, hunk).has_value;
+        });
+        // a token no line has, every line is kept as it is
+        double absent = time_ns([&] {
+            replaced = replaced && DarcsPatch::Commute::tryTokReplaces<char, StringAdapter::CharAdapter>(*chars, "qux", "baz", hunk).has_value;
+        });
+        std::printf("  line length %8zu    %8.2f ns/byte    hunk %8.2f ns/byte    absent %8.2f ns/byte    replaced %d\n", length, replace / total, both / (2 * total), absent / total, replaced);
+    }
+}
+
+int main() {
+    small_lists<0>();
+    small_lists<1>();
+    small_lists<2>();
+    small_lists<4>();
+    walk<DarcsPatch::FL<int>>("FL walk");
+    walk<DarcsPatch::RL<int>>("RL walk");
+    push_after_extract<DarcsPatch::FL<int>>("FL push after extract");
+    push_after_extract<DarcsPatch::RL<int>>("RL push after extract");
+    push_list<DarcsPatch::FL<int>>("FL push(FL)");
+    push_list<DarcsPatch::RL<int>>("RL push(RL)");
+    set_contains<DarcsPatch::Set<int>>("Set contains");
+    set_contains<DarcsPatch::HashSet<int>>("HashSet contains");
+    map_insert("Map insert keeping every version");
+    deps_graph("depsGraph");
+    deps_graph_files("depsGraph over 64 files");
+    tok_replace("tryTokReplaces over 10 MB");
+    return 0;
+}
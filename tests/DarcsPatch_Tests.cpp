@@ -2,6 +2,72 @@
 
 #include <darcs_patch.h>
 
+#include <atomic>
+#include <cstdlib>
+#include <new>
+#include <random>
+#include <sstream>
+#include <thread>
+
+// counts every global allocation made by the test binary
+
+static std::atomic<std::size_t> allocation_count { 0 };
+
+void * operator new(std::size_t size) {
+    allocation_count++;
+    if (void * p = std::malloc(size == 0 ? 1 : size)) {
+        return p;
+    }
+    throw std::bad_alloc();
+}
+
+// not inlined, so g++ does not see free() called on memory from operator
+// new and warn with -Wmismatched-new-delete
+
+[[gnu::noinline]] void operator delete(void * p) noexcept {
+    std::free(p);
+}
+
+[[gnu::noinline]] void operator delete(void * p, std::size_t /*size*/) noexcept {
+    std::free(p);
+}
+
+// the message of the std::runtime_error * f throws, as the library throws
+// them, or "" when it returns
+
+template <typename F>
+static std::string thrown_what(F && f) {
+    try {
+        f();
+    } catch (std::runtime_error * e) {
+        std::string what = e->what();
+        delete e;
+        return what;
+    }
+    return std::string();
+}
+
+// what f returns as printed, or the message of what it throws
+
+template <typename F>
+static std::string printed_or_thrown(F && f) {
+    std::ostringstream out;
+    std::string what = thrown_what([&] { out << f(); });
+    return what.empty() ? out.str() : what;
+}
+
+// the empty path and the files a and b, for patches on several files
+
+static const DarcsPatch::AnchorPath_T paths[] = {
+    DarcsPatch::AnchorPath_T(),
+    DarcsPatch::AnchorPath_T(DarcsPatch::Set<StringAdapter::CharAdapter>().insert("a")),
+    DarcsPatch::AnchorPath_T(DarcsPatch::Set<StringAdapter::CharAdapter>().insert("b")),
+};
+
+static DarcsPatch::Named_T<DarcsPatch::Core_FP_T> named(const char * label, const DarcsPatch::FL<DarcsPatch::Core_FP_T> & prims, const DarcsPatch::Set<DarcsPatch::PatchInfo_T> & deps = {}) {
+    return DarcsPatch::Named_T<DarcsPatch::Core_FP_T>(DarcsPatch::makePatchInfo_T(label), deps, prims);
+}
+
 #define ERASE_TEST(T, it_begin, it_end, index) \
 { \
     { \
@@ -129,3 +195,917 @@ TEST(DarcsPatch_, RL_) {
     ERASE_TEST(RL, begin(), end(), 4);
     ERASE_TEST(RL, begin(), end(), 5);
 }
+
+#define ALLOCATION_TEST(T) \
+{ \
+    DarcsPatch::T<int> list = {1, 2, 3, 4}; \
+    std::size_t before = allocation_count; \
+    { \
+        DarcsPatch::T<int> empty; \
+        DarcsPatch::T<int> copy = list; \
+        DarcsPatch::T<int> moved = std::move(copy); \
+        copy = moved; \
+        moved = std::move(copy); \
+        int a; \
+        DarcsPatch::T<int> rest; \
+        list.extract(a, rest); \
+        int sum = 0; \
+        for (const int & item : rest) sum += item; \
+        for (std::size_t i = 0; i < moved.size(); i++) sum += moved[i]; \
+        EXPECT_EQ(sum, 16); \
+        EXPECT_EQ(empty.size(), 0); \
+    } \
+    EXPECT_EQ(allocation_count - before, 0); \
+}
+
+TEST(DarcsPatch_, FL_RL_copy_and_extract_do_not_allocate) {
+    ALLOCATION_TEST(FL);
+    ALLOCATION_TEST(RL);
+}
+
+TEST(DarcsPatch_, FL_RL_small_lists_do_not_allocate) {
+    std::size_t before = allocation_count;
+    {
+        DarcsPatch::FL<int> fl_a = DarcsPatch::FL<int>().push(1);
+        DarcsPatch::FL<int> fl_b = fl_a.push(2);
+        DarcsPatch::FL<int> fl_c = fl_a.push(3);
+        DarcsPatch::RL<int> rl = DarcsPatch::RL<int>().push(1).push(2);
+        int a;
+        DarcsPatch::RL<int> rest;
+        rl.extract(a, rest);
+        EXPECT_EQ(fl_b[0], 2);
+        EXPECT_EQ(fl_c[0], 3);
+        EXPECT_EQ(fl_c[1], 1);
+        EXPECT_EQ(a, 2);
+        EXPECT_EQ(rest.push(rest)[1], 1);
+    }
+    EXPECT_EQ(allocation_count - before, 0);
+
+    // growing past the inline items keeps every version intact
+    DarcsPatch::RL<int> rl = {1, 2};
+    DarcsPatch::RL<int> rl_3 = rl.push(3);
+    DarcsPatch::RL<int> rl_4 = rl_3.push(rl);
+    EXPECT_EQ(rl, DarcsPatch::RL<int>({1, 2}));
+    EXPECT_EQ(rl_3, DarcsPatch::RL<int>({1, 2, 3}));
+    EXPECT_EQ(rl_4, DarcsPatch::RL<int>({1, 2, 3, 1, 2}));
+}
+
+TEST(DarcsPatch_, FL_RL_push_onto_older_versions) {
+    DarcsPatch::FL<int> fl_a = DarcsPatch::FL<int>().push(1);
+    DarcsPatch::FL<int> fl_b = fl_a.push(2);
+    DarcsPatch::FL<int> fl_c = fl_b.push(3);
+    DarcsPatch::FL<int> fl_d = fl_a.push(8);
+    int a;
+    DarcsPatch::FL<int> rest;
+    fl_c.extract(a, rest);
+    DarcsPatch::FL<int> fl_e = rest.push(9);
+    EXPECT_EQ(fl_a, DarcsPatch::FL<int>({1}));
+    EXPECT_EQ(fl_b, DarcsPatch::FL<int>({1, 2}));
+    EXPECT_EQ(fl_c, DarcsPatch::FL<int>({1, 2, 3}));
+    EXPECT_EQ(fl_d, DarcsPatch::FL<int>({1, 8}));
+    EXPECT_EQ(fl_e, DarcsPatch::FL<int>({1, 2, 9}));
+    EXPECT_EQ(a, 3);
+
+    DarcsPatch::RL<int> rl;
+    std::vector<DarcsPatch::RL<int>> versions;
+    for (int i = 0; i < 200; i++) {
+        versions.push_back(rl);
+        rl = rl.push(i);
+    }
+    for (int i = 0; i < 200; i += 7) {
+        DarcsPatch::RL<int> branch = versions[i].push(-i);
+        ASSERT_EQ(branch.size(), i + 1);
+        EXPECT_EQ(branch[i], -i);
+        for (int j = 0; j < i; j++) {
+            EXPECT_EQ(branch[j], j);
+        }
+        EXPECT_EQ(versions[i].size(), i);
+    }
+    for (int i = 0; i < 200; i++) {
+        EXPECT_EQ(rl[i], i);
+    }
+}
+
+TEST(DarcsPatch_, Builder_) {
+    DarcsPatch::FL<int>::Builder fl_builder;
+    DarcsPatch::RL<int>::Builder rl_builder;
+    fl_builder.reserve(4);
+    rl_builder.reserve(4);
+    for (int i = 1; i <= 4; i++) {
+        fl_builder.push(i);
+        rl_builder.push(i);
+    }
+    DarcsPatch::FL<int> fl = fl_builder.freeze();
+    DarcsPatch::RL<int> rl = rl_builder.freeze();
+    EXPECT_EQ(fl, DarcsPatch::FL<int>({1, 2, 3, 4}));
+    EXPECT_EQ(rl, DarcsPatch::RL<int>({1, 2, 3, 4}));
+    EXPECT_EQ(fl_builder.size(), 0);
+    EXPECT_EQ(fl.push(5), DarcsPatch::FL<int>({1, 2, 3, 4, 5}));
+    EXPECT_EQ(DarcsPatch::ToRL(fl), DarcsPatch::RL<int>({4, 3, 2, 1}));
+    EXPECT_EQ(DarcsPatch::ToFL(rl), fl);
+}
+
+TEST(DarcsPatch_, StaticComparable_) {
+    using T2 = DarcsPatch::Tuple2<int, int>;
+    // comparison and hashing add nothing to the size of an object
+    EXPECT_EQ(sizeof(T2), 2 * sizeof(int));
+    EXPECT_EQ(sizeof(DarcsPatch::Maybe<int>), sizeof(std::pair<bool, int>));
+    EXPECT_LT(T2(1, 2), T2(1, 3));
+    EXPECT_GT(T2(2, 0), T2(1, 3));
+    EXPECT_EQ(T2(1, 2), T2(1, 2));
+    EXPECT_NE(T2(1, 2), T2(2, 1));
+    EXPECT_EQ(T2(1, 2).hashCode(), T2(1, 2).hashCode());
+    EXPECT_EQ(DarcsPatch::FL<int>({1, 2}).hashCode(), DarcsPatch::FL<int>({1, 2}).hashCode());
+    EXPECT_LT(DarcsPatch::RL<int>({1, 2}), DarcsPatch::RL<int>({1, 3}));
+}
+
+TEST(DarcsPatch_, Set_) {
+    DarcsPatch::Set<int> set;
+    DarcsPatch::HashSet<int> hash_set;
+    DarcsPatch::HashSet<int> hash_set_reversed;
+    for (int i = 0; i < 100; i += 3) {
+        set.insert_in_place(i);
+        hash_set.insert_in_place(i);
+        hash_set_reversed.insert_in_place(99 - (99 - i));
+    }
+    for (int i = 0; i < 100; i++) {
+        EXPECT_EQ(set.contains(i), i % 3 == 0);
+        EXPECT_EQ(hash_set.contains(i), i % 3 == 0);
+    }
+    EXPECT_EQ(hash_set, hash_set_reversed);
+    EXPECT_EQ(hash_set.hashCode(), hash_set_reversed.hashCode());
+
+    DarcsPatch::HashSet<int> a = DarcsPatch::HashSet<int>().insert(1).insert(2);
+    DarcsPatch::HashSet<int> b = DarcsPatch::HashSet<int>().insert(2).insert(3);
+    DarcsPatch::HashSet<int> u = a.Union(b);
+    EXPECT_EQ(u.size(), 3);
+    EXPECT_TRUE(u.contains(1) && u.contains(2) && u.contains(3));
+    EXPECT_LT(a, b);
+    EXPECT_LT(a, u);
+    EXPECT_EQ(DarcsPatch::Set<int>().insert(1).insert(2).Union(DarcsPatch::Set<int>().insert(3)), DarcsPatch::Set<int>().insert(3).insert(2).insert(1));
+}
+
+TEST(DarcsPatch_, Set_Map_persistent_) {
+    DarcsPatch::Set<int> set;
+    DarcsPatch::Map<int, int> map;
+    for (int i = 0; i < 1024; i++) {
+        set.insert_in_place(i * 2);
+        map.insert_in_place(i, i * i);
+    }
+
+    // a new version only copies the path to the new item
+    std::size_t before = allocation_count;
+    DarcsPatch::Set<int> set_2 = set.insert(7);
+    DarcsPatch::Map<int, int> map_2 = map.insert(-1, 1);
+    EXPECT_LT(allocation_count - before, 64);
+    before = allocation_count;
+    DarcsPatch::Set<int> set_3 = set.Union(set);
+    EXPECT_EQ(allocation_count - before, 0);
+
+    EXPECT_FALSE(set.contains(7));
+    EXPECT_TRUE(set_2.contains(7));
+    EXPECT_EQ(set.size(), 1024);
+    EXPECT_EQ(set_2.size(), 1025);
+    EXPECT_EQ(set_3, set);
+    EXPECT_FALSE(map.contains(-1));
+    EXPECT_EQ(map_2.lookup(-1).value, 1);
+    EXPECT_EQ(map_2.lookup(30).value, 900);
+    EXPECT_FALSE(map_2.lookup(5000).has_value);
+
+    // inserting an existing key keeps the first value, as std::map does
+    EXPECT_EQ(map.insert(3, 0).lookup(3).value, 9);
+
+    DarcsPatch::Set<int> odd;
+    for (int i = 1; i < 100; i += 2) {
+        odd.insert_in_place(i);
+    }
+    DarcsPatch::Set<int> u = set.Union(odd);
+    EXPECT_EQ(u.size(), 1024 + 50);
+    int previous = -1;
+    for (const int & item : u) {
+        EXPECT_LT(previous, item);
+        previous = item;
+    }
+    EXPECT_EQ(*u.rbegin(), 2046);
+}
+
+TEST(DarcsPatch_, CompressedBitset_) {
+    DarcsPatch::CompressedBitset sparse;
+    DarcsPatch::CompressedBitset dense;
+    for (uint32_t i = 0; i < 200000; i += 1000) {
+        sparse.insert(i);
+    }
+    for (uint32_t i = 0; i < 10000; i++) {
+        dense.insert(i);
+    }
+    EXPECT_EQ(sparse.size(), 200);
+    EXPECT_EQ(dense.size(), 10000);
+    EXPECT_TRUE(sparse.contains(199000));
+    EXPECT_FALSE(sparse.contains(199001));
+    DarcsPatch::CompressedBitset u = DarcsPatch::CompressedBitset::Union(sparse, dense);
+    EXPECT_EQ(u.size(), 10000 + 190);
+    uint32_t previous = 0;
+    std::size_t count = 0;
+    for (uint32_t id : u) {
+        if (count++ != 0) {
+            EXPECT_LT(previous, id);
+        }
+        previous = id;
+    }
+    EXPECT_EQ(count, u.size());
+    EXPECT_EQ(previous, 199000);
+
+    // a union that adds nothing shares the original
+    std::size_t before = allocation_count;
+    DarcsPatch::CompressedBitset same = DarcsPatch::CompressedBitset::Union(u, dense);
+    EXPECT_EQ(allocation_count - before, 0);
+    EXPECT_EQ(same.size(), u.size());
+}
+
+TEST(DarcsPatch_, PatchSet_) {
+    using namespace DarcsPatch;
+    auto index = std::make_shared<PatchIndex_T>();
+    PatchInfo_T a("a");
+    PatchInfo_T b("b");
+    PatchInfo_T c("c");
+    index->add(a);
+    index->add(b);
+    index->add(c);
+    PatchSet_T s1 = PatchSet_T(index).insert(c).insert(a);
+    PatchSet_T s2 = PatchSet_T(index).insert(b);
+    PatchSet_T u = s1.Union(s2);
+    EXPECT_TRUE(s1.contains(a));
+    EXPECT_FALSE(s1.contains(b));
+    EXPECT_FALSE(s1.contains(PatchInfo_T("d")));
+    EXPECT_EQ(u.size(), 3);
+    EXPECT_EQ(*u.begin(), a);
+    EXPECT_EQ(u, PatchSet_T(index).insert(a).insert(b).insert(c));
+    EXPECT_EQ(PatchSet_T().Union(s1), s1);
+    EXPECT_THROW(s1.insert(PatchInfo_T("d")), std::runtime_error);
+}
+
+TEST(DarcsPatch_, LazyValue_) {
+    std::atomic<int> calls { 0 };
+    auto captured = std::make_shared<int>(42);
+    std::weak_ptr<int> weak = captured;
+    DarcsPatch::LazyValue<int> lazy([&calls, captured] { calls++; return *captured + 1; });
+    captured.reset();
+    DarcsPatch::LazyValue<int> copy = lazy;
+
+    std::vector<std::thread> threads;
+    std::atomic<int> sum { 0 };
+    for (int i = 0; i < 8; i++) {
+        threads.emplace_back([&, i] { sum += (i % 2 ? lazy : copy)(); });
+    }
+    for (auto & thread : threads) {
+        thread.join();
+    }
+    EXPECT_EQ(calls, 1);
+    EXPECT_EQ(sum, 8 * 43);
+    // the closure and everything it captured is gone once forced
+    EXPECT_TRUE(weak.expired());
+
+    // a closure that throws is run again on the next call
+    int attempts = 0;
+    DarcsPatch::LazyValue<int> flaky([&attempts] {
+        if (attempts++ == 0) throw std::runtime_error("first");
+        return 7;
+    });
+    EXPECT_THROW(flaky(), std::runtime_error);
+    EXPECT_EQ(flaky(), 7);
+    EXPECT_EQ(attempts, 2);
+}
+
+TEST(DarcsPatch_, depsGraph_million_patches_) {
+    using namespace DarcsPatch;
+    using Names = Set<StringAdapter::CharAdapter>;
+    // a million distinct hunks, eight to a file. on each file four pairs
+    // of hunks at lines far apart, the second hunk of a pair changes the
+    // line the first one added so only it depends on the first, and every
+    // patch is only folded over the few before it on its own file
+    const std::size_t count = 1000000;
+    const std::size_t per_file = 8;
+    auto add = makeNamedWithType_T("add", makeAddFile());
+    auto last = makeNamedHunk_T("last", 1, "", "y");
+    auto hunk = [](std::size_t i) {
+        const AnchorPath_T file(Names().insert(("file " + std::to_string(i / per_file)).c_str()));
+        const std::size_t line = 1 + 10 * (i % per_file / 2);
+        auto prim = i % 2 ? makeHunk_T(line, "x", "y") : makeHunk_T(line, "", "x");
+        return Named_T<Core_FP_T>(makePatchInfo_T(("h" + std::to_string(i)).c_str()), {}, {Core_FP_T(file, prim)});
+    };
+    RL<Named_T<Core_FP_T>>::Builder builder;
+    builder.reserve(count + 2);
+    builder.push(add);
+    for (std::size_t i = 0; i < count; i++) {
+        builder.push(hunk(i));
+    }
+    builder.push(last);
+    auto ps = builder.freeze();
+
+    auto index = makePatchIndex<char, StringAdapter::CharAdapter>(ps);
+    DepsGraph_T graph = depsGraph<char, StringAdapter::CharAdapter>(ps, index);
+    const PatchSet_T none(index);
+    EXPECT_EQ(graph.size(), count + 2);
+    EXPECT_EQ(graph.lookup(ident(add)), Deps_T(none, none));
+    const PatchSet_T on_add = none.insert(ident(add));
+    EXPECT_EQ(graph.lookup(ident(last)), Deps_T(on_add, on_add));
+    for (std::size_t i : {std::size_t(0), std::size_t(1), std::size_t(6), std::size_t(7), std::size_t(123456), std::size_t(123457), count - 2, count - 1}) {
+        const auto id = ident(hunk(i));
+        if (i % 2) {
+            const PatchSet_T on_pair = none.insert(ident(hunk(i - 1)));
+            EXPECT_EQ(graph.lookup(id), Deps_T(on_pair, on_pair)) << i;
+        } else {
+            EXPECT_EQ(graph.lookup(id), Deps_T(none, none)) << i;
+        }
+    }
+}
+
+TEST(DarcsPatch_, depsGraph_parallel_) {
+    using namespace DarcsPatch;
+    std::mt19937 rng(3);
+    RL<Named_T<Core_FP_T>> ps;
+    ps = ps.push(makeNamedWithType_T("add", makeAddFile()));
+    for (int i = 0; i < 120; i++) {
+        // repeated labels give repeated idents, the first of each is kept
+        std::string label = "patch " + std::to_string(rng() % 90);
+        ps = ps.push(makeNamedHunk_T(label.c_str(), 1 + rng() % 20, rng() % 2 ? "x" : "", "y"));
+    }
+    DepsGraph_T serial = depsGraph_T(ps);
+    for (std::size_t threads : {2, 3, 8}) {
+        EXPECT_EQ(depsGraph_T(ps, ParallelOptions{threads}), serial);
+    }
+
+    // a token replace with a non-token throws once something commutes with it
+    auto bad = makeNamedWithType_T("bad", makeTokReplace<char, StringAdapter::CharAdapter>("a-z", "x", "q q"));
+    auto with_bad = ps.push(bad).push(makeNamedHunk_T("after", 1, "", "z"));
+    auto message = [&](std::size_t threads) {
+        return thrown_what([&] { depsGraph_T(with_bad, ParallelOptions{threads}); });
+    };
+    EXPECT_NE(message(1), "");
+    EXPECT_EQ(message(4), message(1));
+}
+
+TEST(DarcsPatch_, extendDepsGraph_) {
+    using namespace DarcsPatch;
+    std::mt19937 rng(5);
+    auto hunks = [&](const char * prefix, int count) {
+        RL<Named_T<Core_FP_T>> ps;
+        for (int i = 0; i < count; i++) {
+            std::string label = prefix + std::to_string(rng() % 60);
+            ps = ps.push(makeNamedHunk_T(label.c_str(), 1 + rng() % 12, rng() % 2 ? "x" : "", "y"));
+        }
+        return ps;
+    };
+    RL<Named_T<Core_FP_T>> ps;
+    ps = ps.push(makeNamedWithType_T("add", makeAddFile())).push(hunks("m", 60));
+    DepsGraph_T g = depsGraph_T(ps);
+
+    // sorting after every existing patch, before some of them, and repeated
+    for (const char * prefix : {"z", "a", "m"}) {
+        auto new_ps = hunks(prefix, 15);
+        EXPECT_EQ(extendDepsGraph_T(g, ps, new_ps), depsGraph_T(ps.push(new_ps)));
+    }
+    EXPECT_EQ(extendDepsGraph_T(DepsGraph_T(), RL<Named_T<Core_FP_T>>(), ps), g);
+
+    // one patch at a time, past the number of indexes that are stacked
+    DepsGraph_T extended = g;
+    RL<Named_T<Core_FP_T>> all = ps;
+    for (int i = 0; i < 12; i++) {
+        std::string label = "z" + std::to_string(10 + i);
+        auto new_ps = RL<Named_T<Core_FP_T>>().push(makeNamedHunk_T(label.c_str(), 1 + rng() % 12, "", "y"));
+        extended = extendDepsGraph_T(extended, all, new_ps);
+        all = all.push(new_ps);
+    }
+    EXPECT_EQ(extended, depsGraph_T(all));
+}
+
+TEST(DarcsPatch_, CommuteCache_) {
+    using namespace DarcsPatch;
+    std::mt19937 rng(9);
+    RL<Named_T<Core_FP_T>> ps;
+    ps = ps.push(makeNamedWithType_T("add", makeAddFile()));
+    for (int i = 0; i < 60; i++) {
+        // two hunks on a file are commuted in full rather than by their lines
+        std::string label = "patch " + std::to_string(i);
+        std::size_t line = 1 + rng() % 12;
+        FL<Core_FP_T> hunks = {Core_FP_T(makeHunk_T(line, rng() % 2 ? "x" : "", "y")), Core_FP_T(makeHunk_T(line + 20, "", "z"))};
+        ps = ps.push(Named_T<Core_FP_T>(makePatchInfo_T(label.c_str()), {}, hunks));
+    }
+    auto index = makePatchIndex<char, StringAdapter::CharAdapter>(ps);
+    auto graph = [&](auto... args) {
+        return depsGraph<char, StringAdapter::CharAdapter>(ps, index, args...);
+    };
+    DepsGraph_T uncached = graph();
+
+    NamedCommuteCache_T cache;
+    EXPECT_EQ(graph(&cache), uncached);
+    const std::size_t misses = cache.misses();
+    EXPECT_GT(misses, 0);
+    EXPECT_EQ(cache.size(), misses);
+
+    // every commute of the second run is cached, from any thread
+    EXPECT_EQ(graph(ParallelOptions{4}, &cache), uncached);
+    EXPECT_EQ(cache.misses(), misses);
+    EXPECT_GE(cache.hits(), misses);
+
+    NamedCommuteCache_T small(32);
+    EXPECT_EQ(graph(&small), uncached);
+    EXPECT_LE(small.size(), 32);
+}
+
+TEST(DarcsPatch_, cleverCommute_inverted_) {
+    using namespace DarcsPatch;
+    using Adapter = StringAdapter::CharAdapter;
+    using Pair = Tuple2<Core_FP_T, Core_FP_T>;
+    std::mt19937 rng(37);
+    const char * lines[] = {"", "foo", "foo\nbar", "x bar y", "bar\nbaz", "baz"};
+    const char * tokens[] = {"foo", "bar", "baz"};
+    auto prim = [&]() -> std::shared_ptr<Patch> {
+        switch (rng() % 6) {
+            case 0: return makeAddFile();
+            case 1: return makeRemoveFile();
+            case 2: return makeTokReplace<char, Adapter>(rng() % 4 ? "A-Za-z_0-9" : "a-z", tokens[rng() % 3], tokens[rng() % 3]);
+            default: return makeHunk_T(1 + rng() % 6, lines[rng() % 6], lines[rng() % 6]);
+        }
+    };
+    auto text = [](const Commute::Perhaps<Pair> & m) {
+        std::ostringstream out;
+        out << m.v1;
+        if (m.v1 == Commute::SUCCEEDED) out << " " << m.v2;
+        return out.str();
+    };
+    // inverse views give what inverting the patches would
+    int succeeded = 0;
+    for (int i = 0; i < 3000; i++) {
+        const Pair p = {Core_FP_T(prim()), Core_FP_T(prim())};
+        auto expected = printed_or_thrown([&] {
+            auto m = Commute::commuteFileDir<char, Adapter>({invert(p.v2), invert(p.v1)});
+            if (m.v1 != Commute::SUCCEEDED) return text({m.v1, {}});
+            return text({Commute::SUCCEEDED, {invert(m.v2.v2), invert(m.v2.v1)}});
+        });
+        auto inverted = printed_or_thrown([&] { return text(Commute::commuteFileDir<char, Adapter>(p, true)); });
+        ASSERT_EQ(inverted, expected) << p;
+        succeeded += inverted.rfind("2 ", 0) == 0;
+    }
+    EXPECT_GT(succeeded, 0);
+}
+
+TEST(DarcsPatch_, AnchorPath_interned_) {
+    using namespace DarcsPatch;
+    using Names = Set<StringAdapter::CharAdapter>;
+    EXPECT_EQ(AnchorPath_T().id, 0u);
+    EXPECT_EQ(AnchorPath_T(Names()), AnchorPath_T());
+
+    // made in an order other than the order of their names
+    const AnchorPath_T zz(Names().insert("interned zz"));
+    const AnchorPath_T aa(Names().insert("interned aa"));
+    EXPECT_NE(zz.id, aa.id);
+    EXPECT_NE(zz, aa);
+    EXPECT_EQ(AnchorPath_T(Names().insert("interned zz")).id, zz.id);
+    EXPECT_TRUE(aa < zz);
+    EXPECT_FALSE(zz < aa);
+    EXPECT_FALSE(aa < aa);
+    EXPECT_TRUE(aa <= aa);
+    EXPECT_EQ(aa.names(), Names().insert("interned aa"));
+    EXPECT_EQ(aa.hashCode(), AnchorPath_T(Names().insert("interned aa")).hashCode());
+
+    // every thread gets the same id for the same names
+    std::vector<std::uint32_t> ids(4 * 100);
+    std::vector<std::thread> threads;
+    for (std::size_t t = 0; t < 4; t++) {
+        threads.emplace_back([&, t] {
+            for (std::size_t i = 0; i < 100; i++) {
+                ids[t * 100 + i] = AnchorPath_T(Names().insert(("threaded " + std::to_string(i)).c_str())).id;
+            }
+        });
+    }
+    for (auto & thread : threads) thread.join();
+    for (std::size_t t = 1; t < 4; t++) {
+        EXPECT_TRUE(std::equal(ids.begin(), ids.begin() + 100, ids.begin() + t * 100));
+    }
+    EXPECT_EQ(std::set<std::uint32_t>(ids.begin(), ids.end()).size(), 100u);
+}
+
+TEST(DarcsPatch_, Named_touch_summary_) {
+    using namespace DarcsPatch;
+    using Names = Set<StringAdapter::CharAdapter>;
+
+    auto p = named("p", {Core_FP_T(paths[1], makeHunk_T(3, "x", "y\ny")), Core_FP_T(paths[2], makeHunk_T(2, "", "y")), Core_FP_T(paths[2], makeHunk_T(7, "x", "")), Core_FP_T(paths[0], makeAddFile())});
+    auto & files = p.touched()->files;
+    ASSERT_EQ(files.size(), 3);
+    EXPECT_EQ(files[0].path, paths[0]);
+    EXPECT_FALSE(files[0].hunks_only);
+    EXPECT_TRUE(files[1].lone_hunk());
+    EXPECT_EQ(files[1].line, 3);
+    EXPECT_EQ(files[1].old_lines, 1);
+    EXPECT_EQ(files[1].new_lines, 2);
+    EXPECT_FALSE(files[2].lone_hunk());
+    EXPECT_EQ(files[2].prims, 2);
+    EXPECT_TRUE(p.touched()->touches_any_of(*named("q", {Core_FP_T(paths[2], makeHunk_T(1, "", "z"))}).touched()));
+    EXPECT_FALSE(p.touched()->touches_any_of(*named("q", {Core_FP_T(AnchorPath_T(Names().insert("c")), makeHunk_T(1, "", "z"))}).touched()));
+
+    // reversing the prims keeps the summary, as it would be made again
+    auto r = p.reversed();
+    EXPECT_EQ(r.touched(), p.touched());
+    std::ostringstream reversed, expected;
+    reversed << r.p;
+    expected << ToFL(ToRL(p.p));
+    EXPECT_EQ(reversed.str(), expected.str());
+
+    // commute1 gives the same patches whether or not it can skip the prims
+    std::mt19937 rng(17);
+    auto random_prims = [&] {
+        FL<Core_FP_T> prims;
+        for (std::size_t k = rng() % 4; k-- > 0;) {
+            const AnchorPath_T & path = paths[rng() % 3];
+            std::size_t line = 1 + rng() % 10;
+            prims = prims.push(Core_FP_T(path, rng() % 4 == 0 ? makeAddFile() : makeHunk_T(line, rng() % 2 ? "x" : "", "y")));
+        }
+        return prims;
+    };
+    // commuting a hunk makes a new one, so compare what the prims print as
+    auto text = [](const FL<Core_FP_T> & prims) {
+        std::ostringstream o;
+        o << prims;
+        return o.str();
+    };
+    int skipped = 0;
+    for (int i = 0; i < 500; i++) {
+        auto x = named("x", random_prims());
+        auto y = named("y", random_prims());
+        auto expected = Commute::commute1_<char, StringAdapter::CharAdapter>({x.p, y.p});
+        auto got = Commute::commute1<char, StringAdapter::CharAdapter>({x, y});
+        ASSERT_EQ(got.has_value, expected.has_value);
+        if (got.has_value) {
+            EXPECT_EQ(text(got->v1.p), text(expected->v1));
+            EXPECT_EQ(text(got->v2.p), text(expected->v2));
+            EXPECT_EQ(got->v2.touched()->files.size(), x.touched()->files.size());
+        }
+        skipped += !x.touched()->touches_any_of(*y.touched());
+    }
+    EXPECT_GT(skipped, 50);
+}
+
+TEST(DarcsPatch_, FileRangeIndex_) {
+    using namespace DarcsPatch;
+    std::mt19937 rng(11);
+    using Names = Set<StringAdapter::CharAdapter>;
+    std::vector<PatchInfo_T> names;
+    auto random_patch = [&](int i) {
+        std::string label = "patch " + std::to_string(i);
+        FL<Core_FP_T> prims;
+        for (std::size_t k = 1 + rng() % 3; k-- > 0;) {
+            const AnchorPath_T & path = paths[rng() % 3];
+            std::size_t line = 1 + rng() % 10;
+            switch (rng() % 6) {
+                case 0: prims = prims.push(Core_FP_T(path, makeTokReplace<char, StringAdapter::CharAdapter>("A-Za-z", "foo", "bar"))); break;
+                case 1: prims = prims.push(Core_FP_T(path, makeHunk_T(line, "", ""))); break;
+                case 2: prims = prims.push(Core_FP_T(path, makeAddFile())); break;
+                default: prims = prims.push(Core_FP_T(path, makeHunk_T(line, rng() % 2 ? "x foo\nx" : "", "y"))); break;
+            }
+        }
+        Set<PatchInfo_T> deps;
+        if (!names.empty() && rng() % 8 == 0) {
+            deps = deps.insert(names[rng() % names.size()]);
+        }
+        names.push_back(makePatchInfo_T(label.c_str()));
+        return Named_T<Core_FP_T>(names.back(), deps, prims);
+    };
+
+    // commute1 reverses the prims of the first patch, also past a patch on
+    // another file, which decides whether two hunks on one file commute
+    {
+        const AnchorPath_T c(Names().insert("c"));
+        auto q = named("q", {Core_FP_T(paths[1], makeHunk_T(1, "", "z")), Core_FP_T(c, makeHunk_T(4, "", "y")), Core_FP_T(c, makeHunk_T(4, "x foo", "y"))});
+        auto other_file = named("other file", {Core_FP_T(paths[0], makeHunk_T(7, "x", "y\ny")), Core_FP_T(paths[2], makeHunk_T(3, "x\nx foo", ""))});
+        auto same_file = named("same file", {Core_FP_T(c, makeHunk_T(6, "", "y\ny")), Core_FP_T(paths[0], makeHunk_T(4, "x foo\nx foo", "y"))});
+        FileRangeIndex<char, StringAdapter::CharAdapter> index;
+        index.push(same_file);
+        index.push(other_file);
+        auto sequence = FL<Named_T<Core_FP_T>>().push(same_file).push(other_file);
+        bool expected = commuteFL<char, StringAdapter::CharAdapter>({q, sequence}).has_value;
+        EXPECT_TRUE(expected);
+        EXPECT_EQ(index.commute(q), expected);
+    }
+
+    // the same as commuteFL for every patch, whether it commutes or not, and
+    // some are pushed without commuting as foldDeps does with indirect deps
+    int commuted = 0;
+    int failed = 0;
+    for (int round = 0; round < 200; round++) {
+        FileRangeIndex<char, StringAdapter::CharAdapter> index;
+        FL<Named_T<Core_FP_T>> sequence;
+        for (int i = 0; i < 30; i++) {
+            auto q = random_patch(round * 100 + i);
+            if (rng() % 3 == 0) {
+                index.push(q);
+                sequence = sequence.push(q);
+                continue;
+            }
+            auto expected = commuteFL<char, StringAdapter::CharAdapter>({q, sequence});
+            ASSERT_EQ(index.commute(q), expected.has_value);
+            if (expected.has_value) {
+                sequence = expected->v1;
+                commuted++;
+            } else {
+                index.push(q);
+                sequence = sequence.push(q);
+                failed++;
+            }
+            ASSERT_EQ(index.sequence(), sequence);
+        }
+    }
+    EXPECT_GT(commuted, 100);
+    EXPECT_GT(failed, 100);
+}
+
+TEST(DarcsPatch_, shardByFile_) {
+    using namespace DarcsPatch;
+    using Names = Set<StringAdapter::CharAdapter>;
+    auto on = [](const char * label, std::initializer_list<const char *> files, const Set<PatchInfo_T> & deps = {}) {
+        FL<Core_FP_T> prims;
+        for (const char * file : files) {
+            prims = prims.push(Core_FP_T(AnchorPath_T(Names().insert(file)), makeHunk_T(1, "", "x")));
+        }
+        return named(label, prims, deps);
+    };
+    RL<Named_T<Core_FP_T>> ps = {
+        on("a1", {"a"}), on("b1", {"b"}), on("c1", {"c"}), on("d1", {"d"}),
+        on("a2", {"a"}), on("bc", {"b", "c"}), on("e1", {"e"}, Set<PatchInfo_T>().insert(makePatchInfo_T("d1"))),
+        on("none", {}), on("a1", {"f"}),
+    };
+    auto sharded = shardByFile<char, StringAdapter::CharAdapter>(ps, makePatchIndex<char, StringAdapter::CharAdapter>(ps));
+    // a and f share the ident a1, b and c a patch, d and e a dependency
+    EXPECT_EQ(sharded.shard_of, std::vector<std::size_t>({0, 1, 1, 2, 0, 1, 2, 3, 0}));
+    ASSERT_EQ(sharded.shards.size(), 4);
+    EXPECT_EQ(sharded.shards[0], RL<Named_T<Core_FP_T>>({ps[0], ps[4], ps[8]}));
+    EXPECT_EQ(sharded.shards[1], RL<Named_T<Core_FP_T>>({ps[1], ps[2], ps[5]}));
+
+    // many files, a few patches on two of them, and one that throws
+    std::mt19937 rng(19);
+    RL<Named_T<Core_FP_T>> history;
+    for (int i = 0; i < 300; i++) {
+        std::string a = std::to_string(rng() % 40);
+        std::string b = rng() % 10 == 0 ? std::to_string(rng() % 40) : a;
+        FL<Core_FP_T> prims = {
+            Core_FP_T(AnchorPath_T(Names().insert(a.c_str())), makeHunk_T(1 + rng() % 8, rng() % 2 ? "x" : "", "y")),
+            Core_FP_T(AnchorPath_T(Names().insert(b.c_str())), makeHunk_T(10 + rng() % 8, "", "y")),
+        };
+        history = history.push(Named_T<Core_FP_T>(makePatchInfo_T(("patch " + std::to_string(i)).c_str()), {}, prims));
+    }
+    DepsGraph_T serial = depsGraph_T(history);
+    EXPECT_EQ(serial.size(), 300);
+    for (std::size_t threads : {2, 5}) {
+        EXPECT_EQ(depsGraph_T(history, ParallelOptions{threads}), serial);
+    }
+    auto bad = Named_T<Core_FP_T>(makePatchInfo_T("bad"), {}, {Core_FP_T(AnchorPath_T(Names().insert("7")), makeTokReplace<char, StringAdapter::CharAdapter>("a-z", "x", "q q"))});
+    auto with_bad = history.push(bad).push(history);
+    auto message = [&](std::size_t threads) {
+        return thrown_what([&] { depsGraph_T(with_bad, ParallelOptions{threads}); });
+    };
+    EXPECT_NE(message(1), "");
+    EXPECT_EQ(message(4), message(1));
+}
+
+TEST(DarcsPatch_, RegChars_) {
+    auto matches = [](const char * spec, const char * chars) {
+        auto f = DarcsPatch::Commute::RegChars<char, StringAdapter::CharAdapter>(StringAdapter::CharAdapter(spec));
+        std::string r;
+        for (const char * c = chars; *c; c++) {
+            if (f(*c)) r += *c;
+        }
+        return r;
+    };
+    EXPECT_EQ(matches("A-Za-z_0-9", "aZ_5- .q"), "aZ_5q");
+    EXPECT_EQ(matches("abc", "abcd-"), "abc");
+    EXPECT_EQ(matches("^abc", "abcd-"), "d-");
+    EXPECT_EQ(matches("\\^ab", "^abc"), "^ab");
+    EXPECT_EQ(matches("a\\-b", "a-bc"), "a-b");
+
+    // an unsupported escape only throws for characters not matched before it
+    auto f = DarcsPatch::Commute::RegChars<char, StringAdapter::CharAdapter>(StringAdapter::CharAdapter("a\\qb"));
+    EXPECT_TRUE(f('a'));
+    EXPECT_THROW(f('b'), std::runtime_error *);
+
+    // the compiled tables read a spec as the recursive normalRegChars does
+    auto compare = [](const auto & spec) {
+        using char_t = typename std::decay<decltype(spec[0])>::type;
+        typename DarcsPatch::FL<char_t>::Builder builder;
+        for (std::size_t i = spec.size(); i-- > 0;) builder.push(spec[i]);
+        DarcsPatch::FL<char_t> cs = builder.freeze();
+        std::function<bool(const char_t &)> expected = [](const char_t &) { return false; };
+        if (cs.size() != 0) {
+            char_t c;
+            DarcsPatch::FL<char_t> tmp;
+            cs.extract(c, tmp);
+            if (spec[0] == '^') {
+                expected = [=] (const char_t & f) { return !DarcsPatch::Commute::normalRegChars<char_t>(DarcsPatch::Commute::unescapeChars<char_t>(tmp))(f); };
+            } else {
+                auto rest = spec[0] == '\\' && spec.size() > 1 && spec[1] == '^' ? tmp : cs;
+                expected = [=] (const char_t & f) { return DarcsPatch::Commute::normalRegChars<char_t>(DarcsPatch::Commute::unescapeChars<char_t>(rest))(f); };
+            }
+        }
+        auto got = DarcsPatch::Commute::RegChars<char_t>(cs);
+        auto result = [](const std::function<bool(const char_t &)> & f, const char_t & c) {
+            return printed_or_thrown([&] { return f(c) ? "1" : "0"; });
+        };
+        for (int c = -128; c < 384; c++) {
+            const char_t ch = (char_t) c;
+            ASSERT_EQ(result(got, ch), result(expected, ch));
+        }
+    };
+    std::mt19937 rng(19);
+    const char alphabet[] = "^\\-.ntaAzZ09_\x80\xff";
+    for (int i = 0; i < 500; i++) {
+        std::string spec;
+        for (std::size_t k = rng() % 8; k-- > 0;) spec += alphabet[rng() % (sizeof(alphabet) - 1)];
+        compare(spec);
+        compare(std::u32string(spec.begin(), spec.end()));
+    }
+
+    // compiled once per patch, and shared with its inverse
+    auto patch = DarcsPatch::makeTokReplace<char, StringAdapter::CharAdapter>("A-Za-z", "foo", "bar");
+    using TokReplace = DarcsPatch::TokReplace<char, StringAdapter::CharAdapter>;
+    auto * t = static_cast<TokReplace *>(patch.get());
+    EXPECT_TRUE((*t->chars)('q'));
+    EXPECT_FALSE((*t->chars)('-'));
+    EXPECT_EQ(static_cast<TokReplace *>(patch->invert().get())->chars, t->chars);
+}
+
+TEST(DarcsPatch_, tryTokReplace_) {
+    using namespace DarcsPatch;
+    using Adapter = StringAdapter::CharAdapter;
+    auto replace = [](const char * spec, const char * o, const char * n, const std::string & input) {
+        return Commute::tryTokReplace<char, Adapter>(Adapter(spec), Adapter(o), Adapter(n), Adapter(input));
+    };
+    EXPECT_EQ(replace("a-z", "foo", "bar", "foo food (foo)"), Maybe<Adapter>(Adapter("bar food (bar)")));
+    EXPECT_FALSE(replace("a-z", "foo", "bar", "foo bar").has_value);
+    EXPECT_EQ(printed_or_thrown([&] { return replace("a-z", "foo", "b-r", "foo"); }), "tryTokReplace called with new non-token");
+
+    // the same as the token by token loop, including where it throws
+    std::mt19937 rng(23);
+    const char * specs[] = {"a-z", "^ ", "a-z\\q", "fobar"};
+    const char alphabet[] = "fobar -_q";
+    for (int i = 0; i < 2000; i++) {
+        const TokChars<char> chars = *TokReplace<char, Adapter>::compile(specs[rng() % 4]);
+        std::string input;
+        // long enough for some to be scanned in blocks of 64
+        for (std::size_t k = rng() % (i % 2 ? 24 : 200); k-- > 0;) input += alphabet[rng() % (sizeof(alphabet) - 1)];
+        const Adapter o(rng() % 2 ? "foo" : "fo");
+        const Adapter n(rng() % 2 ? "bar" : "ob");
+        auto expected = printed_or_thrown([&] {
+            auto items = Commute::loop<char, Adapter>(0, chars, o, n, std::make_shared<Adapter>(input));
+            if (!items.has_value) return Maybe<Adapter>(Nothing());
+            Adapter acc;
+            for (const auto & item : items.value_ref()) acc.append_(*item);
+            return Maybe<Adapter>(acc);
+        });
+        ASSERT_EQ(printed_or_thrown([&] { return Commute::tryTokReplace<char, Adapter>(chars, o, n, Adapter(input)); }), expected) << input;
+    }
+
+    // both line lists of a hunk, checking the tokens once, as two calls
+    // to tryTokReplaces would
+    for (int i = 0; i < 500; i++) {
+        const TokChars<char> chars = *TokReplace<char, Adapter>::compile(specs[rng() % 4]);
+        RL<Adapter> lines[2];
+        for (auto & list : lines) {
+            for (std::size_t k = rng() % 3; k-- > 0;) {
+                std::string line;
+                for (std::size_t j = rng() % 12; j-- > 0;) line += alphabet[rng() % (sizeof(alphabet) - 1)];
+                list = list.push(Adapter(line));
+            }
+        }
+        const Adapter o(rng() % 8 ? "foo" : "f-o");
+        const Adapter n(rng() % 2 ? "bar" : "ob");
+        auto expected = printed_or_thrown([&] {
+            auto old1 = Commute::tryTokReplaces<char, Adapter>(chars, o, n, lines[0]);
+            if (!old1.has_value) return Maybe<Tuple2<RL<Adapter>, RL<Adapter>>>(Nothing());
+            auto new1 = Commute::tryTokReplaces<char, Adapter>(chars, o, n, lines[1]);
+            if (!new1.has_value) return Maybe<Tuple2<RL<Adapter>, RL<Adapter>>>(Nothing());
+            return Maybe<Tuple2<RL<Adapter>, RL<Adapter>>>({old1.value_ref(), new1.value_ref()});
+        });
+        ASSERT_EQ(printed_or_thrown([&] { return Commute::tryTokReplacesHunk<char, Adapter>(chars, o, n, lines[0], lines[1]); }), expected);
+    }
+
+    // a line far longer than any token is scanned once
+    std::string line;
+    for (int i = 0; i < 100000; i++) line += i % 3 ? "foo " : "x ";
+    auto replaced = replace("a-z", "foo", "bar", line);
+    ASSERT_TRUE(replaced.has_value);
+    EXPECT_EQ(replaced.value_ref().size(), line.size());
+}
+
+TEST(DarcsPatch_, TokChars_token_starts_) {
+    using namespace DarcsPatch;
+    using SCAN = TokChars<char>::SCAN;
+    std::mt19937 rng(29);
+    // the last spec has more runs of bytes than the vector scans take
+    const char * specs[] = {"A-Za-z_0-9", "^ \t", "a-z", "^a-z", "", "^", "\x80-\xff", "acegikmoqsuwy"};
+    for (int i = 0; i < 2000; i++) {
+        const std::string spec = specs[rng() % 8];
+        const TokChars<char> chars(std::vector<char>(spec.begin(), spec.end()));
+        std::string input;
+        for (std::size_t k = rng() % 300; k-- > 0;) {
+            input += rng() % 4 ? "aZ_0 \t-\x90"[rng() % 9] : (char) rng();
+        }
+        const char a = "a_Z\x90"[rng() % 4];
+        const char b = "z0 "[rng() % 3];
+        std::vector<std::size_t> expected;
+        for (std::size_t j = 0; j < input.size(); j++) {
+            if (chars(input[j]) && (j == 0 || !chars(input[j - 1])) && (input[j] == a || input[j] == b)) {
+                expected.push_back(j);
+            }
+        }
+        for (SCAN scan : {TokChars<char>::SCALAR, TokChars<char>::SSE2, TokChars<char>::AVX2, TokChars<char>::BEST}) {
+            std::vector<std::size_t> starts;
+            chars.token_starts(input.data(), input.size(), a, b, [&](std::size_t at) {
+                starts.push_back(at);
+                return true;
+            }, scan);
+            ASSERT_EQ(starts, expected) << spec << " " << scan;
+            // stops when f returns false
+            starts.clear();
+            EXPECT_EQ(chars.token_starts(input.data(), input.size(), a, b, [&](std::size_t at) {
+                starts.push_back(at);
+                return false;
+            }, scan), expected.empty());
+            EXPECT_EQ(starts.size(), expected.empty() ? 0 : 1);
+        }
+    }
+}
+
+TEST(DarcsPatch_, FileHunk_token_blooms_) {
+    using namespace DarcsPatch;
+    using Adapter = StringAdapter::CharAdapter;
+    using Hunk = FileHunk<char, Adapter>;
+    RL<Adapter> old_lines = RL<Adapter>().push(Adapter("int foo = 1;")).push(Adapter("")).push(Adapter("bar(foo_x)"));
+    RL<Adapter> new_lines = RL<Adapter>().push(Adapter("baz"));
+    auto hunk = std::make_shared<Hunk>(3, old_lines, new_lines);
+    EXPECT_EQ(hunk->old_blooms(), TokenBloom<char>::of_lines(old_lines));
+    EXPECT_EQ(hunk->new_blooms(), TokenBloom<char>::of_lines(new_lines));
+    EXPECT_EQ(hunk->old_blooms()[1], 0u);
+    for (const char * token : {"int", "foo", "1", "bar", "foo_x"}) {
+        const std::string s = token;
+        EXPECT_TRUE(TokenBloom<char>::may_have(hunk->old_blooms()[0] | hunk->old_blooms()[2], TokenBloom<char>::of_token(s.begin(), s.end()))) << token;
+    }
+
+    // moved and inverted hunks share the blooms of the hunk they are made from
+    auto moved = std::static_pointer_cast<Hunk>(hunk->at_line(7));
+    EXPECT_EQ(moved->line, 7u);
+    EXPECT_EQ(&moved->old_blooms(), &hunk->old_blooms());
+    auto inverted = std::static_pointer_cast<Hunk>(hunk->invert());
+    EXPECT_EQ(&inverted->old_blooms(), &hunk->new_blooms());
+    EXPECT_EQ(&inverted->new_blooms(), &hunk->old_blooms());
+
+    // the lines can not be changed under the blooms made from them
+    static_assert(std::is_const<std::remove_reference_t<decltype((hunk->old_lines))>>::value, "old_lines must be const");
+    static_assert(std::is_const<std::remove_reference_t<decltype((hunk->new_lines))>>::value, "new_lines must be const");
+
+    // skipping the lines the blooms rule out gives what scanning every
+    // line does, and a class other than the default ignores the blooms
+    std::mt19937 rng(31);
+    const char * specs[] = {"A-Za-z_0-9", "a-z"};
+    const char * words[] = {"foo", "bar", "fo", "x_1", "Foo", " ", "-", "(", "9"};
+    for (int i = 0; i < 1000; i++) {
+        const TokChars<char> chars = *TokReplace<char, Adapter>::compile(specs[rng() % 2]);
+        RL<Adapter> lines[2];
+        for (auto & list : lines) {
+            for (std::size_t k = rng() % 4; k-- > 0;) {
+                std::string line;
+                for (std::size_t j = rng() % 8; j-- > 0;) line += words[rng() % 9];
+                list = list.push(Adapter(line));
+            }
+        }
+        const Hunk h(1, lines[0], lines[1]);
+        const Adapter o(rng() % 2 ? "foo" : "x_1");
+        const Adapter n(rng() % 2 ? "bar" : "Foo");
+        auto expected = printed_or_thrown([&] { return Commute::tryTokReplacesHunk<char, Adapter>(chars, o, n, lines[0], lines[1]); });
+        ASSERT_EQ(printed_or_thrown([&] { return Commute::tryTokReplacesHunk<char, Adapter>(chars, o, n, lines[0], lines[1], &h.old_blooms(), &h.new_blooms()); }), expected);
+    }
+}
+
+TEST(DarcsPatch_, FL_RL_push_list_) {
+    DarcsPatch::FL<int> fl = {1, 2};
+    DarcsPatch::RL<int> rl = {1, 2};
+    EXPECT_EQ(fl.push(DarcsPatch::FL<int>({3, 4})), DarcsPatch::FL<int>({1, 2, 3, 4}));
+    EXPECT_EQ(rl.push(DarcsPatch::RL<int>({3, 4})), DarcsPatch::RL<int>({1, 2, 3, 4}));
+    EXPECT_EQ(fl.push(DarcsPatch::FL<int>()), fl);
+    EXPECT_EQ(DarcsPatch::RL<int>().push(rl), rl);
+    EXPECT_EQ(fl, DarcsPatch::FL<int>({1, 2}));
+    EXPECT_EQ(rl, DarcsPatch::RL<int>({1, 2}));
+
+    // concatenating a list with itself many times keeps every item reachable
+    DarcsPatch::RL<int> big = {0};
+    for (int i = 0; i < 16; i++) {
+        big = big.push(big).push(i + 1);
+    }
+    std::size_t expected = 1;
+    for (int i = 0; i < 16; i++) {
+        expected = expected * 2 + 1;
+    }
+    ASSERT_EQ(big.size(), expected);
+    EXPECT_EQ(big[0], 0);
+    EXPECT_EQ(big[1], 0);
+    EXPECT_EQ(big[2], 1);
+    EXPECT_EQ(big[big.size() - 1], 16);
+}